@@ -2,6 +2,7 @@
 // Created by zj on 11/29/2023.
 //
 
+#include <algorithm>
 #include <numeric>
 #include "book_system.h"
 void Book::toBytes(char *dest) const {
@@ -58,12 +59,47 @@ bool Book::hasKeyword(const std::string &keywords, const std::string &keyword) {
 }
 template
 class external_memory::List<Book, false>;
-void BookSystem::initialize(bool reset) {
+void BookSystem::initialize(bool reset, bool reset_index) {
   book_list_.initialize(reset);
-  ISBN_to_id_.initialize(reset);
-  title_to_id_.initialize(reset);
-  author_to_id_.initialize(reset);
-  keyword_to_id_.initialize(reset);
+  wal_.protect(book_list_);
+  ISBN_to_id_.initialize(reset || reset_index);
+  title_to_id_.initialize(reset || reset_index);
+  author_to_id_.initialize(reset || reset_index);
+  keyword_to_id_.initialize(reset || reset_index);
+}
+void BookSystem::restore(unsigned int id, const Book &book) {
+  book_list_.extend(id);
+  book_list_.set(id, book);
+}
+void BookSystem::rebuildIndex() {
+  std::vector<std::pair<std::string, unsigned int>> ISBNs;
+  for (unsigned int id = 1; id <= book_list_.size(); ++id) {
+    Book book = get(id);
+    if (book.ISBN.empty()) continue;
+    ISBNs.emplace_back(book.ISBN, id);
+    if (!book.title.empty()) title_to_id_.insert(book.title, id);
+    if (!book.author.empty()) author_to_id_.insert(book.author, id);
+    if (!book.keywords.empty()) {
+      for (auto &keyword : Book::unpackKeywords(book.keywords)) {
+        keyword_to_id_.insert(keyword, id);
+      }
+    }
+  }
+  ISBN_to_id_.bulkLoad(ISBNs);
+}
+void BookSystem::checkpoint() {
+  book_list_.flush();
+  ISBN_to_id_.checkpoint();
+  title_to_id_.checkpoint();
+  author_to_id_.checkpoint();
+  keyword_to_id_.checkpoint();
+}
+void BookSystem::sync() {
+  book_list_.sync();
+  ISBN_to_id_.sync();
+  title_to_id_.sync();
+  author_to_id_.sync();
+  keyword_to_id_.sync();
 }
 unsigned int BookSystem::find(const std::string &ISBN) {
   return ISBN_to_id_.at(ISBN);
@@ -73,21 +109,25 @@ Book BookSystem::get(unsigned int id) {
 }
 unsigned int BookSystem::select(const std::string &ISBN) {
   unsigned int &id = ISBN_to_id_[ISBN];
-  if (!id) id = book_list_.insert(Book(ISBN));
+  if (!id) {
+    Book book(ISBN);
+    id = book_list_.insert(book);
+    wal_.log(kRecordType::kBook, id, book);
+  }
   return id;
 }
 kExceptionType BookSystem::modify(unsigned int id, const Book &old, const Book &new_book) {
   if (old.ISBN != new_book.ISBN) {
-    unsigned int &new_id = ISBN_to_id_[new_book.ISBN];
-    if (new_id) return kExceptionType::K_DUPLICATED_ISBN;
+    if (ISBN_to_id_.at(new_book.ISBN)) return kExceptionType::K_DUPLICATED_ISBN;
     ISBN_to_id_.erase(old.ISBN);
-    new_id = id;
+    ISBN_to_id_.insert(new_book.ISBN, id);
   }
-  // There is no erase method in MultiMap. Erasing is done lazily.
   if (old.title != new_book.title) {
+    if (!old.title.empty()) title_to_id_.erase(old.title, id);
     title_to_id_.insert(new_book.title, id);
   }
   if (old.author != new_book.author) {
+    if (!old.author.empty()) author_to_id_.erase(old.author, id);
     author_to_id_.insert(new_book.author, id);
   }
   if (old.keywords != new_book.keywords) {
@@ -96,7 +136,7 @@ kExceptionType BookSystem::modify(unsigned int id, const Book &old, const Book &
     auto old_it = old_keywords.begin();
     for (auto new_it = new_keywords.begin(); new_it != new_keywords.end(); ++new_it) {
       while (old_it != old_keywords.end() && *old_it < *new_it) {
-        // There is no erase method in MultiMap. Erasing is done lazily.
+        if (!old_it->empty()) keyword_to_id_.erase(*old_it, id);
         ++old_it;
       }
       if (old_it == old_keywords.end() || *old_it > *new_it) {
@@ -105,8 +145,12 @@ kExceptionType BookSystem::modify(unsigned int id, const Book &old, const Book &
         ++old_it;
       }
     }
+    for (; old_it != old_keywords.end(); ++old_it) {
+      if (!old_it->empty()) keyword_to_id_.erase(*old_it, id);
+    }
   }
   book_list_.set(id, new_book);
+  wal_.log(kRecordType::kBook, id, new_book);
   return kExceptionType::K_SUCCESS;
 }
 BookSystem::SearchResult BookSystem::searchByISBN(const std::string &ISBN) {
@@ -117,63 +161,30 @@ BookSystem::SearchResult BookSystem::searchByISBN(const std::string &ISBN) {
 BookSystem::SearchResult BookSystem::searchByTitle(const std::string &title) {
   SearchResult result;
   auto ids = title_to_id_.findAll(title);
-  size_t size_before = ids.size();
-  std::sort(ids.begin(), ids.end());
-  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
   result.books.reserve(ids.size());
-  std::erase_if(ids, [this, &result, &title](unsigned int id) {
+  for (int id : ids) {
     Book book = get(id);
-    if (book.title == title) {
-      result.books.push_back(book);
-      return false;
-    } else {
-      return true;
-    }
-  });
-  if (ids.size() < size_before) {
-    title_to_id_.update(title, std::move(ids));
+    if (book.title == title) result.books.push_back(book);
   }
   return result;
 }
 BookSystem::SearchResult BookSystem::searchByAuthor(const std::string &author) {
   SearchResult result;
   auto ids = author_to_id_.findAll(author);
-  size_t size_before = ids.size();
-  std::sort(ids.begin(), ids.end());
-  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
   result.books.reserve(ids.size());
-  std::erase_if(ids, [this, &result, &author](unsigned int id) {
+  for (int id : ids) {
     Book book = get(id);
-    if (book.author == author) {
-      result.books.push_back(book);
-      return false;
-    } else {
-      return true;
-    }
-  });
-  if (ids.size() < size_before) {
-    author_to_id_.update(author, std::move(ids));
+    if (book.author == author) result.books.push_back(book);
   }
   return result;
 }
 BookSystem::SearchResult BookSystem::searchByKeyword(const std::string &keyword) {
   SearchResult result;
   auto ids = keyword_to_id_.findAll(keyword);
-  size_t size_before = ids.size();
-  std::sort(ids.begin(), ids.end());
-  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
   result.books.reserve(ids.size());
-  std::erase_if(ids, [this, &result, &keyword](unsigned int id) {
+  for (int id : ids) {
     Book book = get(id);
-    if (Book::hasKeyword(book.keywords, keyword)) {
-      result.books.push_back(book);
-      return false;
-    } else {
-      return true;
-    }
-  });
-  if (ids.size() < size_before) {
-    keyword_to_id_.update(keyword, std::move(ids));
+    if (Book::hasKeyword(book.keywords, keyword)) result.books.push_back(book);
   }
   return result;
 }
@@ -194,7 +205,6 @@ std::vector<Book> BookSystem::search(const Book &params) {
 }
 BookSystem::SearchResult BookSystem::getAllBooks() {
   SearchResult result;
-  book_list_.cache();
   result.books.reserve(book_list_.size());
   for (unsigned int id = 1; id <= book_list_.size(); ++id) {
     result.books.push_back(get(id));
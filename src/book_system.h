@@ -105,18 +105,20 @@ struct Book {
  * @details 5. search: search books by ISBN, title, author or keyword
  * @details The information of books is stored in external memory.
  * @details The BookSystem class uses external_memory::List, external_memory::Map, external_memory::MultiMap and external_memory::Vectors to store the information of books. The external_memory::Vectors is shared with other systems.
- * @details The external_memory::MultiMap may contain duplicated or erased items because modifying doesn't erase the items immediately. They are lazily removed by `searchByTitle`, `searchByAuthor` and `searchByKeyword`.
+ * @details Modifying a book erases its ID from the old title, author and keywords in the external_memory::MultiMap, so searching only reads. The old values are read from the book itself, which serves as the reverse index.
  * @attention The BookSystem class must be initialized before using.
  */
 class BookSystem {
  private:
+  static constexpr unsigned int kBookFrameCount = 1024; // the number of cached pages of the list of books
   const std::string file_prefix_; // the prefix (including path) of the files storing the information of books
   external_memory::List<Book, false> book_list_; // the list of books
-  external_memory::Map<std::string> ISBN_to_id_; // the map from ISBN to ID
+  external_memory::Map<std::string> ISBN_to_id_; // the map from ISBN to ID, with a filter for unknown ISBNs
   external_memory::MultiMap<std::string> title_to_id_; // the map from title to ID
   external_memory::MultiMap<std::string> author_to_id_; // the map from author to ID
   external_memory::MultiMap<std::string> keyword_to_id_; // the map from keyword to ID
   external_memory::Vectors &vectors_; // the vectors used by external memory, shared with other systems
+  WriteAheadLog &wal_; // the write-ahead log, shared with other systems
   struct SearchResult {
     std::vector<Book> books;
 
@@ -126,22 +128,23 @@ class BookSystem {
 
   SearchResult getAllBooks();
   SearchResult searchByISBN(const std::string &ISBN);
-  SearchResult searchByTitle(const std::string &title); // Also removes the duplicated and erased items in title_to_id_
-  SearchResult searchByAuthor(const std::string &author); // Also removes the duplicated and erased items in author_to_id_
-  SearchResult searchByKeyword(const std::string &keyword); // There must be only one keyword, which is not checked here. Also removes the duplicated and erased items in keyword_to_id_
+  SearchResult searchByTitle(const std::string &title);
+  SearchResult searchByAuthor(const std::string &author);
+  SearchResult searchByKeyword(const std::string &keyword); // There must be only one keyword, which is not checked here.
  public:
   /**
    * @brief Construct a new BookSystem object
    * @param file_prefix The prefix (and path) of the files storing the information of books
    * @param vectors The vectors used by external memory, shared with other systems
+   * @param wal The write-ahead log, shared with other systems
    */
-  BookSystem(std::string file_prefix, external_memory::Vectors &vectors)
-      : file_prefix_(std::move(file_prefix)), book_list_(file_prefix_ + "_list"),
-        ISBN_to_id_(file_prefix_ + "_ISBN"),
+  BookSystem(std::string file_prefix, external_memory::Vectors &vectors, WriteAheadLog &wal)
+      : file_prefix_(std::move(file_prefix)), book_list_(file_prefix_ + "_list", kBookFrameCount),
+        ISBN_to_id_(file_prefix_ + "_ISBN", external_memory::Map<std::string>::kDefaultBucketCount, true),
         title_to_id_(file_prefix_ + "_title", vectors),
         author_to_id_(file_prefix_ + "_author", vectors),
         keyword_to_id_(file_prefix_ + "_keyword", vectors),
-        vectors_(vectors) {}
+        vectors_(vectors), wal_(wal) {}
   /**
    * @brief Destroy the BookSystem object
    */
@@ -149,11 +152,34 @@ class BookSystem {
   /**
    * @brief Initialize the BookSystem object
    * @param reset Whether to reset the BookSystem object
+   * @param reset_index Whether to reset the indexes only, which should be rebuilt with `rebuildIndex` afterwards
    * @attention vectors_ must be initialized before calling this function, no matter whether reset is true or not.
    * @attention This function must not be called twice.
    * @attention If reset is true, all the information of books will be lost.
    */
-  void initialize(bool reset = false);
+  void initialize(bool reset = false, bool reset_index = false);
+  /**
+   * @brief Restore a book from the write-ahead log
+   * @param id The ID of the book
+   * @param book The book
+   * @details Only the list of books is modified. The indexes should be rebuilt with `rebuildIndex` afterwards.
+   */
+  void restore(unsigned int id, const Book &book);
+  /**
+   * @brief Rebuild the indexes (ISBN, title, author and keyword) from the list of books
+   * @attention The indexes must be empty.
+   */
+  void rebuildIndex();
+  /**
+   * @brief Write all cached data of books back to the files
+   * @attention The shared vectors are not included.
+   */
+  void checkpoint();
+  /**
+   * @brief Write the files of books to the disk, after `checkpoint`
+   * @attention The shared vectors are not included.
+   */
+  void sync();
   /**
    * @brief Find a book by ISBN
    * @param ISBN The ISBN of the book
@@ -183,7 +209,7 @@ class BookSystem {
    * @return K_DUPLICATED_ISBN if the ISBN of the book is duplicated
    * @details The information of the book is modified in external memory.
    * @details The information of the book is modified in external_memory::List, external_memory::Map, external_memory::MultiMap and external_memory::Vectors.
-   * @details The external_memory::MultiMap may contain duplicated or erased items because modifying doesn't erase the items immediately. They are lazily removed by `searchByTitle`, `searchByAuthor` and `searchByKeyword`.
+   * @details The ID of the book is erased from the old title, author and keywords, and inserted to the new ones.
    */
   [[nodiscard]] kExceptionType modify(unsigned int id, const Book &old, const Book &new_book);
   /**
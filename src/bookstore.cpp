@@ -6,16 +6,39 @@
 void BookStore::initialize(bool force_reset) {
   bool reset = force_reset;
   if (!force_reset) {
-    std::ifstream file(file_prefix_ + "_data_data.db"); // a file that belongs to the `Vectors` class
+    std::ifstream file(use_tablespace_ ? tablespace_.name()
+                                       : file_prefix_ + "_data_data.db"); // a file that belongs to the `Vectors` class
     reset = !file.is_open(); // if the file does not exist or cannot be opened, reset the database
   }
-  vectors_.initialize(reset);
-  book_system_.initialize(reset);
-  user_system_.initialize(reset);
+  if (use_tablespace_) tablespace_.open(reset); // the files opened below become its segments
+  wal_.initialize(reset);
+  bool recover = !reset && !wal_.empty(); // the last run did not exit normally
+  vectors_.initialize(reset || recover); // the vectors only store indexes, which are rebuilt when recovering
+  book_system_.initialize(reset, recover);
+  user_system_.initialize(reset, recover);
   finance_log_.initialize(reset);
+  if (recover) {
+    wal_.replay([this](const WriteAheadLog::Record &record) {
+      switch (record.type) {
+        case kRecordType::kBook: book_system_.restore(record.id, Book(record.data));
+          break;
+        case kRecordType::kUser: user_system_.restore(record.id, User(record.data));
+          break;
+        case kRecordType::kUserErase: user_system_.restore(record.id, User());
+          break;
+        case kRecordType::kFinance: finance_log_.restore(record.id, FinanceRecord(record.data));
+          break;
+        default: break;
+      }
+    });
+    book_system_.rebuildIndex();
+    user_system_.rebuildIndex();
+  }
   if (reset) {
     user_system_.useradd("root", "sjtu", "root", 7); // add a root user
   }
+  wal_.commit();
+  last_checkpoint_ = std::chrono::steady_clock::now();
 }
 kExceptionType BookStore::login(const std::string &user_id, const std::string &password) {
   if (!validator::isValidUserID(user_id)) return kExceptionType::K_INVALID_PARAMETER;
@@ -35,7 +58,9 @@ kExceptionType BookStore::useradd(const std::string &user_id,
   if (!validator::isValidPrivilege(privilege)) return kExceptionType::K_INVALID_PARAMETER;
   if (user_system_.getPrivilege() <= privilege)
     return kExceptionType::K_PERMISSION_DENIED; // privilege check: the privilege of the current user must be greater than the privilege of the user to be added
-  return user_system_.useradd(user_id, password, name, privilege);
+  auto result = user_system_.useradd(user_id, password, name, privilege);
+  wal_.commit();
+  return result;
 }
 kExceptionType BookStore::customerUseradd(const std::string &user_id,
                                           const std::string &password,
@@ -44,7 +69,9 @@ kExceptionType BookStore::customerUseradd(const std::string &user_id,
   if (!validator::isValidPassword(password)) return kExceptionType::K_INVALID_PARAMETER;
   if (!validator::isValidUserName(name)) return kExceptionType::K_INVALID_PARAMETER;
   // this command does not require privilege check
-  return user_system_.useradd(user_id, password, name, 1);
+  auto result = user_system_.useradd(user_id, password, name, 1);
+  wal_.commit();
+  return result;
 }
 kExceptionType BookStore::passwd(const std::string &user_id,
                                  const std::string &new_password,
@@ -56,13 +83,17 @@ kExceptionType BookStore::passwd(const std::string &user_id,
     return kExceptionType::K_PERMISSION_DENIED; // privilege check: the privilege of the current user must be greater than 1
   if (old_password.empty() && user_system_.getPrivilege() < 7)
     return kExceptionType::K_PERMISSION_DENIED; // privilege check: if the old password is not provided, the privilege of the current user must be 7
-  return user_system_.passwd(user_id, new_password, old_password);
+  auto result = user_system_.passwd(user_id, new_password, old_password);
+  wal_.commit();
+  return result;
 }
 kExceptionType BookStore::deluser(const std::string &user_id) {
   if (!validator::isValidUserID(user_id)) return kExceptionType::K_INVALID_PARAMETER;
   if (user_system_.getPrivilege() < 7)
     return kExceptionType::K_PERMISSION_DENIED; // privilege check: the privilege of the current user must be 7
-  return user_system_.deluser(user_id);
+  auto result = user_system_.deluser(user_id);
+  wal_.commit();
+  return result;
 }
 std::pair<kExceptionType, std::vector<Book>> BookStore::search(const Book &params) {
   if (!params.ISBN.empty() && !validator::isValidISBN(params.ISBN)) return {kExceptionType::K_INVALID_PARAMETER, {}};
@@ -82,6 +113,7 @@ kExceptionType BookStore::select(const std::string &ISBN) {
   if (user_system_.getPrivilege() < 3)
     return kExceptionType::K_PERMISSION_DENIED; // privilege check: the privilege of the current user must be greater than 3
   auto id = book_system_.select(ISBN);
+  wal_.commit();
   return user_system_.select(id);
 }
 kExceptionType BookStore::modify(Book &&new_book) {
@@ -115,7 +147,9 @@ kExceptionType BookStore::modify(Book &&new_book) {
     new_book.price = old_book.price;
   }
   new_book.quantity = old_book.quantity; // the quantity cannot be modified by this command
-  return book_system_.modify(selected_id, old_book, new_book);
+  auto result = book_system_.modify(selected_id, old_book, new_book);
+  wal_.commit();
+  return result;
 }
 kExceptionType BookStore::import_(unsigned int quantity, unsigned long long int cost) {
   if (!validator::isValidQuantity(quantity)) return kExceptionType::K_INVALID_PARAMETER;
@@ -128,7 +162,9 @@ kExceptionType BookStore::import_(unsigned int quantity, unsigned long long int
   Book new_book = book;
   new_book.quantity += quantity;
   finance_log_.log(-static_cast<long long>(cost));
-  return book_system_.modify(selected_id, book, new_book);
+  auto result = book_system_.modify(selected_id, book, new_book);
+  wal_.commit();
+  return result;
 }
 std::pair<kExceptionType, unsigned long long> BookStore::purchase(const std::string &ISBN, unsigned int quantity) {
   if (!validator::isValidISBN(ISBN)) return {kExceptionType::K_INVALID_PARAMETER, 0};
@@ -143,7 +179,9 @@ std::pair<kExceptionType, unsigned long long> BookStore::purchase(const std::str
   Book new_book = book;
   new_book.quantity -= quantity;
   finance_log_.log(static_cast<long long>(book.price) * quantity);
-  return {book_system_.modify(id, book, new_book), book.price * quantity};
+  auto result = book_system_.modify(id, book, new_book);
+  wal_.commit();
+  return {result, book.price * quantity};
 }
 std::pair<kExceptionType, FinanceRecord> BookStore::showFinance(unsigned int count) {
   if (user_system_.getPrivilege() < 7)
@@ -161,3 +199,32 @@ std::pair<kExceptionType, FinanceRecord> BookStore::showFinance() {
   if (!finance_log.valid()) return {kExceptionType::K_NOT_ENOUGH_RECORDS, FinanceRecord()};
   return {kExceptionType::K_SUCCESS, finance_log};
 }
+BookStore::~BookStore() {
+  if (!wal_.isOpen()) return;
+  writeBack();
+  wal_.close();
+}
+void BookStore::writeBack() {
+  wal_.commit();
+  vectors_.checkpoint();
+  book_system_.checkpoint();
+  user_system_.checkpoint();
+  finance_log_.checkpoint();
+  if (use_tablespace_) {
+    tablespace_.sync();
+  } else {
+    vectors_.sync();
+    book_system_.sync();
+    user_system_.sync();
+    finance_log_.sync();
+  }
+}
+void BookStore::checkpoint() {
+  writeBack();
+  wal_.checkpoint();
+  last_checkpoint_ = std::chrono::steady_clock::now();
+}
+void BookStore::idle() {
+  wal_.commit();
+  if (std::chrono::steady_clock::now() - last_checkpoint_ >= kCheckpointInterval) checkpoint();
+}
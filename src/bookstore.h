@@ -31,26 +31,49 @@
  * @details For example, `useradd` requires the privilege of the current user to be greater than the privilege of the user to be added.
  * @details This check is done by the `UserSystem` class.
  * @details This class also performs parameter checks.
+ * @details Every mutating command is recorded in a write-ahead log, so that the effects of committed commands survive a crash.
+ * @details Optionally, all the files of the database are segments of a single tablespace file, `<prefix>_tablespace.db`.
+ * @details If the last run did not exit normally, `initialize` replays the log into the books, users and finance records, and rebuilds the indexes from them.
  * @attention `initialize` should be called before using this class.
  * @attention Parameter checks should be performed by the caller if the check does not involve the information stored in the database.
  * @attention For example, `BookName` should not contain '"', which should be checked by the caller.
  */
 class BookStore {
  private:
+  static constexpr unsigned int
+      kVectorFrameCount = 256; // the number of cached pages of the vectors, which are shared by all the multimaps
+  static constexpr std::chrono::seconds
+      kCheckpointInterval{60}; // the minimum time between two checkpoints, which bounds the size of the write-ahead log
   const std::string file_prefix_; // the prefix (including path) of the files storing the information of books
+  const bool use_tablespace_; // whether all the files of the database are segments of a single tablespace file
+  external_memory::Tablespace tablespace_; // the tablespace, declared first so that it is closed after all its segments
+  WriteAheadLog wal_; // the write-ahead log, declared before the systems that log to it and force it before their pages are written back
   external_memory::Vectors vectors_; // the vectors used by external memory, shared with other systems
   BookSystem book_system_; // the book system
   UserSystem user_system_; // the user system
   FinanceLog finance_log_; // the finance log
+  std::chrono::steady_clock::time_point last_checkpoint_; // the time of the last checkpoint
+  void writeBack(); // end the current command, write all cached data back to the files, and synchronize the files
  public:
   /// \brief Construct a new BookStore object
-  explicit BookStore(std::string file_prefix = "bookstore") : file_prefix_(std::move(file_prefix)),
-                                                              vectors_(file_prefix_ + "_data"),
-                                                              book_system_(file_prefix_ + "_book", vectors_),
-                                                              user_system_(file_prefix_ + "_user"),
-                                                              finance_log_(file_prefix_ + "_finance_log") {}
+  /// \param file_prefix The prefix (and path) of the files of the database
+  /// \param sync_policy When the write-ahead log is synchronized to the disk
+  /// \param sync_interval The sync interval, only for kSyncPolicy::kInterval
+  /// \param use_tablespace Whether to store all the files of the database in a single tablespace file
+  explicit BookStore(std::string file_prefix = "bookstore",
+                     kSyncPolicy sync_policy = kSyncPolicy::kInterval,
+                     std::chrono::milliseconds sync_interval = std::chrono::milliseconds(1000),
+                     bool use_tablespace = external_memory::kDefaultUseTablespace)
+      : file_prefix_(std::move(file_prefix)), use_tablespace_(use_tablespace),
+        tablespace_(file_prefix_),
+        wal_(file_prefix_, sync_policy, sync_interval),
+        vectors_(file_prefix_ + "_data", kVectorFrameCount),
+        book_system_(file_prefix_ + "_book", vectors_, wal_),
+        user_system_(file_prefix_ + "_user", wal_),
+        finance_log_(file_prefix_ + "_finance_log", wal_) {}
   /// \brief Destroy the BookStore object
-  ~BookStore() = default;
+  /// \details All cached data is written back and synchronized before the write-ahead log is closed, marking a normal exit.
+  ~BookStore();
   /**
    * @brief Initialize the BookStore object
    * @details This function initializes the BookStore object and the external memory.
@@ -61,6 +84,7 @@ class BookStore {
    * @attention This function must not be called twice.
    * @attention If force_reset is true, all the information of the bookstore will be lost.
    * @attention If force_reset is false but the database is corrupted, the behavior is undefined.
+   * @attention Files written by a crashed run are repaired with the write-ahead log, see the class description.
    */
   void initialize(bool force_reset = false);
   /**
@@ -202,6 +226,16 @@ class BookStore {
    * @return K_PERMISSION_DENIED if the privilege of the current user is less than 7
    */
   std::pair<kExceptionType, FinanceRecord> showFinance();
+  /**
+   * @brief Write all cached data back to the files, synchronize them, and truncate the write-ahead log
+   */
+  void checkpoint();
+  /**
+   * @brief Do background work between two commands
+   * @details The write-ahead log is synchronized if the sync policy requires so, even if the last command did not modify anything.
+   * @details A checkpoint is made if `kCheckpointInterval` has elapsed since the last one.
+   */
+  void idle();
 };
 
 #endif //BOOKSTORE_SRC_BOOKSTORE_H_
@@ -56,6 +56,7 @@ void BookStoreCLI::runCommand(const BookStoreCLI::Args &args, Func func) {
     // for debug
 //    std::cerr << "Error: " << exceptionTypeToString(ret) << endl;
   }
+  book_store_.idle();
   // for debug
 //  os.flush();
 //  if (ret == kExceptionType::K_SUCCESS) std::cerr << exceptionTypeToString(ret) << endl;
@@ -0,0 +1,390 @@
+//
+// Created by zj on 10/17/2026.
+//
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "external_file.h"
+
+namespace external_memory {
+static constexpr size_t kMinMapCapacity = 1 << 20; // the minimum length of a mapping, in bytes
+static constexpr size_t kCopyBlockSize = 1 << 20; // the size of the blocks in which bytes are copied, in bytes
+
+File::~File() {
+  close();
+}
+void File::open(bool reset) {
+  tablespace_ = Tablespace::find(file_name_);
+  if (tablespace_) {
+    segment_ = tablespace_->segment(file_name_, reset);
+    size_ = tablespace_->size(segment_);
+    return;
+  }
+  fd_ = ::open(file_name_.c_str(), O_RDWR | O_CREAT | (reset ? O_TRUNC : 0), 0644);
+  if (fd_ < 0) {
+    throw std::runtime_error("Cannot open file " + file_name_);
+  }
+  struct stat st{};
+  fstat(fd_, &st);
+  size_ = st.st_size;
+  if (backend_ == Backend::kMmap) map(size_);
+}
+void File::close() {
+  tablespace_ = nullptr;
+  if (fd_ < 0) return;
+  if (map_) munmap(map_, map_capacity_);
+  ::close(fd_);
+  map_ = nullptr;
+  map_capacity_ = 0;
+  fd_ = -1;
+}
+void File::map(size_t capacity) {
+  if (capacity <= map_capacity_) return;
+  size_t new_capacity = std::max(map_capacity_, kMinMapCapacity);
+  while (new_capacity < capacity) new_capacity <<= 1;
+  void *new_map;
+  if (map_) {
+    new_map = mremap(map_, map_capacity_, new_capacity, MREMAP_MAYMOVE);
+  } else {
+    new_map = mmap(nullptr, new_capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  }
+  if (new_map == MAP_FAILED) {
+    throw std::runtime_error("Cannot map file " + file_name_);
+  }
+  map_ = static_cast<char *>(new_map);
+  map_capacity_ = new_capacity;
+}
+void File::read(size_t pos, void *dest, size_t len) {
+  iovec iov{dest, len};
+  readv(pos, &iov, 1);
+}
+void File::write(size_t pos, const void *src, size_t len) {
+  iovec iov{const_cast<void *>(src), len};
+  writev(pos, &iov, 1);
+}
+void File::readv(size_t pos, const iovec *iov, int count) {
+  if (tablespace_) {
+    tablespace_->readv(segment_, pos, iov, count);
+    return;
+  }
+  size_t total = 0;
+  for (int i = 0; i < count; ++i) total += iov[i].iov_len;
+  size_t available = pos < size_ ? std::min(total, size_ - pos) : 0;
+  if (backend_ == Backend::kMmap) {
+    for (int i = 0; i < count; ++i) {
+      size_t len = std::min(iov[i].iov_len, available);
+      memcpy(iov[i].iov_base, map_ + pos, len);
+      memset(static_cast<char *>(iov[i].iov_base) + len, 0, iov[i].iov_len - len);
+      pos += iov[i].iov_len;
+      available -= len;
+    }
+    return;
+  }
+  std::vector<iovec> rest(iov, iov + count);
+  size_t done = 0;
+  for (iovec *it = rest.data(), *end = it + count; it != end && done < available;) {
+    ssize_t n = preadv(fd_, it, static_cast<int>(end - it), static_cast<off_t>(pos + done));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break; // end of file
+    done += n;
+    while (it != end && static_cast<size_t>(n) >= it->iov_len) n -= static_cast<ssize_t>((it++)->iov_len);
+    if (it != end) {
+      it->iov_base = static_cast<char *>(it->iov_base) + n;
+      it->iov_len -= n;
+    }
+  }
+  for (int i = 0; i < count; ++i) { // bytes beyond the end of the file are read as 0
+    if (done >= iov[i].iov_len) {
+      done -= iov[i].iov_len;
+    } else {
+      memset(static_cast<char *>(iov[i].iov_base) + done, 0, iov[i].iov_len - done);
+      done = 0;
+    }
+  }
+}
+void File::writev(size_t pos, const iovec *iov, int count) {
+  if (tablespace_) {
+    tablespace_->writev(segment_, pos, iov, count);
+    size_ = tablespace_->size(segment_);
+    return;
+  }
+  size_t total = 0;
+  for (int i = 0; i < count; ++i) total += iov[i].iov_len;
+  if (backend_ == Backend::kMmap) {
+    reserve(pos + total);
+    for (int i = 0; i < count; ++i) {
+      memcpy(map_ + pos, iov[i].iov_base, iov[i].iov_len);
+      pos += iov[i].iov_len;
+    }
+    return;
+  }
+  std::vector<iovec> rest(iov, iov + count);
+  size_t done = 0;
+  for (iovec *it = rest.data(), *end = it + count; it != end;) {
+    ssize_t n = pwritev(fd_, it, static_cast<int>(end - it), static_cast<off_t>(pos + done));
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) throw std::runtime_error("Cannot write file " + file_name_);
+    done += n;
+    while (it != end && static_cast<size_t>(n) >= it->iov_len) n -= static_cast<ssize_t>((it++)->iov_len);
+    if (it != end) {
+      it->iov_base = static_cast<char *>(it->iov_base) + n;
+      it->iov_len -= n;
+    }
+  }
+  size_ = std::max(size_, pos + total);
+}
+void File::copy(size_t src, size_t dest, size_t len) {
+  if (tablespace_) {
+    tablespace_->copy(segment_, src, dest, len);
+    size_ = tablespace_->size(segment_);
+    return;
+  }
+  if (backend_ == Backend::kMmap) {
+    reserve(dest + len);
+    memcpy(map_ + dest, map_ + src, len);
+    return;
+  }
+  size_t done = 0;
+  while (done < len) { // the copy stays in the kernel
+    auto in = static_cast<off_t>(src + done), out = static_cast<off_t>(dest + done);
+    ssize_t n = copy_file_range(fd_, &in, fd_, &out, len - done, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break; // not supported by the file system, or the source ends early
+    done += n;
+  }
+  size_ = std::max(size_, dest + done);
+  if (done == len) return;
+  std::string block(std::min(len - done, kCopyBlockSize), '\0');
+  for (; done < len; done += block.size()) {
+    size_t count = std::min(block.size(), len - done);
+    read(src + done, block.data(), count);
+    write(dest + done, block.data(), count);
+  }
+}
+void File::resize(size_t size) {
+  if (tablespace_) {
+    tablespace_->resize(segment_, size);
+    size_ = size;
+    return;
+  }
+  if (ftruncate(fd_, static_cast<off_t>(size)) != 0) {
+    throw std::runtime_error("Cannot resize file " + file_name_);
+  }
+  if (backend_ == Backend::kMmap) map(size);
+  size_ = size;
+}
+void File::reserve(size_t size) {
+  if (size <= size_) return;
+  if (backend_ == Backend::kMmap && !tablespace_) {
+    allocate(size); // a store into a hole of a mapping raises SIGBUS if the disk is full
+  } else {
+    resize(size);
+  }
+}
+void File::allocate(size_t size) {
+  if (tablespace_) {
+    reserve(size); // the extents are allocated by the tablespace file
+    return;
+  }
+  if (size > size_) {
+    int error = posix_fallocate(fd_, static_cast<off_t>(size_), static_cast<off_t>(size - size_));
+    if (error == EOPNOTSUPP || error == EINVAL) { // not supported by the file system
+      resize(size);
+      return;
+    }
+    if (error) throw std::runtime_error("Cannot allocate file " + file_name_);
+    if (backend_ == Backend::kMmap) map(size);
+    size_ = size;
+  }
+}
+void File::sync() {
+  if (tablespace_) {
+    tablespace_->sync();
+    return;
+  }
+  if (fd_ < 0) return;
+  if (map_) msync(map_, size_, MS_SYNC);
+  fdatasync(fd_);
+}
+
+Tablespace::~Tablespace() {
+  close();
+}
+void Tablespace::open(bool reset) {
+  file_.open(reset);
+  segments_.clear();
+  if (file_.size() < kSuperblockSize) { // a new tablespace
+    file_.resize(kSuperblockSize);
+    unsigned int header[] = {kMagic, kVersion, 0, 0};
+    file_.write(0, header, sizeof(header));
+  } else {
+    std::string superblock(kSuperblockSize, '\0');
+    file_.read(0, superblock.data(), kSuperblockSize);
+    unsigned int header[4];
+    memcpy(header, superblock.data(), sizeof(header));
+    if (header[0] != kMagic || header[1] != kVersion || header[2] > kMaxSegments) {
+      throw std::runtime_error(file_.name() + " is not a tablespace");
+    }
+    segments_.resize(header[2]);
+    for (unsigned int i = 0; i < header[2]; ++i) {
+      const char *entry = superblock.data() + kHeaderSize + i * kEntrySize;
+      Segment &segment = segments_[i];
+      segment.name.assign(entry, strnlen(entry, kMaxNameLength));
+      unsigned int extent_count;
+      memcpy(&segment.size, entry + kMaxNameLength, sizeof(size_t));
+      memcpy(&extent_count, entry + kMaxNameLength + 8, sizeof(unsigned int));
+      segment.extents.resize(std::min(extent_count, kMaxExtents));
+      memcpy(segment.extents.data(), entry + kMaxNameLength + 16, segment.extents.size() * sizeof(size_t));
+    }
+  }
+  mounted_.push_back(this);
+}
+void Tablespace::close() {
+  std::erase(mounted_, this);
+  file_.close();
+}
+Tablespace *Tablespace::find(const std::string &file_name) {
+  for (Tablespace *tablespace : mounted_) {
+    if (file_name.starts_with(tablespace->prefix_) && file_name != tablespace->file_.name()) return tablespace;
+  }
+  return nullptr;
+}
+unsigned int Tablespace::segment(const std::string &file_name, bool reset) {
+  std::string name = file_name.substr(prefix_.size());
+  auto it = std::find_if(segments_.begin(), segments_.end(), [&name](const Segment &s) { return s.name == name; });
+  auto index = static_cast<unsigned int>(it - segments_.begin());
+  if (it == segments_.end()) {
+    if (segments_.size() == kMaxSegments) throw std::runtime_error("Too many segments in " + file_.name());
+    if (name.size() >= kMaxNameLength) throw std::runtime_error("Segment name too long: " + file_name);
+    segments_.push_back({name, 0, {}});
+    auto count = static_cast<unsigned int>(segments_.size());
+    file_.write(8, &count, sizeof(count));
+  } else if (reset) {
+    it->size = 0; // the extents are kept
+  }
+  store(index);
+  return index;
+}
+void Tablespace::store(unsigned int segment) {
+  const Segment &s = segments_[segment];
+  char entry[kEntrySize]{};
+  memcpy(entry, s.name.data(), s.name.size());
+  auto extent_count = static_cast<unsigned int>(s.extents.size());
+  memcpy(entry + kMaxNameLength, &s.size, sizeof(size_t));
+  memcpy(entry + kMaxNameLength + 8, &extent_count, sizeof(unsigned int));
+  memcpy(entry + kMaxNameLength + 16, s.extents.data(), s.extents.size() * sizeof(size_t));
+  file_.write(kHeaderSize + segment * kEntrySize, entry, kEntrySize);
+}
+void Tablespace::extend(unsigned int segment, size_t size, size_t written) {
+  Segment &s = segments_[segment];
+  if (size <= s.size) return;
+  size_t old_capacity = capacity(s.extents.size());
+  while (capacity(s.extents.size()) < size) {
+    if (s.extents.size() == kMaxExtents) throw std::runtime_error("Segment too large in " + file_.name());
+    size_t position = file_.size(), length = kExtentSize << s.extents.size();
+    file_.reserve(position + length); // new bytes of the tablespace file are 0
+    s.extents.push_back(position);
+  }
+  static const std::vector<char> zero(kExtentSize, '\0');
+  for (size_t pos = s.size, end = std::min(written, old_capacity); pos < end;) { // the old content of reused extents
+    iovec iov{const_cast<char *>(zero.data()), std::min(zero.size(), end - pos)};
+    transfer(segment, pos, &iov, 1, true);
+    pos += iov.iov_len;
+  }
+}
+void Tablespace::transfer(unsigned int segment, size_t pos, const iovec *iov, int count, bool write) {
+  const Segment &s = segments_[segment];
+  std::vector<iovec> run; // buffers that go to consecutive bytes of the tablespace file
+  size_t run_begin = 0, run_end = 0;
+  auto submit = [&]() {
+    if (run.empty()) return;
+    if (write) {
+      file_.writev(run_begin, run.data(), static_cast<int>(run.size()));
+    } else {
+      file_.readv(run_begin, run.data(), static_cast<int>(run.size()));
+    }
+    run.clear();
+  };
+  for (int i = 0; i < count; ++i) {
+    char *base = static_cast<char *>(iov[i].iov_base);
+    for (size_t len = iov[i].iov_len; len > 0;) {
+      auto extent = static_cast<unsigned int>(std::bit_width(pos / kExtentSize + 1) - 1);
+      size_t offset = pos - capacity(extent);
+      size_t n = std::min(len, (kExtentSize << extent) - offset);
+      size_t physical = s.extents[extent] + offset;
+      if (run.empty() || physical != run_end || run.size() == IOV_MAX) {
+        submit();
+        run_begin = physical;
+      }
+      run.push_back({base, n});
+      run_end = physical + n;
+      base += n;
+      pos += n;
+      len -= n;
+    }
+  }
+  submit();
+}
+void Tablespace::readv(unsigned int segment, size_t pos, const iovec *iov, int count) {
+  size_t size = segments_[segment].size;
+  std::vector<iovec> rest(iov, iov + count);
+  size_t available = pos < size ? size - pos : 0;
+  int n = 0;
+  for (; n < count && available > 0; ++n) {
+    rest[n].iov_len = std::min(rest[n].iov_len, available);
+    available -= rest[n].iov_len;
+  }
+  transfer(segment, pos, rest.data(), n, false);
+  for (int i = 0; i < count; ++i) { // bytes beyond the end of the segment are read as 0
+    size_t len = i < n ? rest[i].iov_len : 0;
+    memset(static_cast<char *>(iov[i].iov_base) + len, 0, iov[i].iov_len - len);
+  }
+}
+void Tablespace::writev(unsigned int segment, size_t pos, const iovec *iov, int count) {
+  size_t total = 0;
+  for (int i = 0; i < count; ++i) total += iov[i].iov_len;
+  Segment &s = segments_[segment];
+  extend(segment, pos + total, pos);
+  transfer(segment, pos, iov, count, true);
+  if (pos + total > s.size) {
+    s.size = pos + total;
+    store(segment);
+  }
+}
+void Tablespace::copy(unsigned int segment, size_t src, size_t dest, size_t len) {
+  Segment &s = segments_[segment];
+  extend(segment, dest + len, dest);
+  for (size_t done = 0; done < len;) { // split at the ends of the extents of both ranges
+    size_t n = len - done;
+    size_t physical[2];
+    for (int i = 0; i < 2; ++i) {
+      size_t pos = (i ? dest : src) + done;
+      auto extent = static_cast<unsigned int>(std::bit_width(pos / kExtentSize + 1) - 1);
+      size_t offset = pos - capacity(extent);
+      n = std::min(n, (kExtentSize << extent) - offset);
+      physical[i] = s.extents[extent] + offset;
+    }
+    file_.copy(physical[0], physical[1], n);
+    done += n;
+  }
+  if (dest + len > s.size) {
+    s.size = dest + len;
+    store(segment);
+  }
+}
+void Tablespace::resize(unsigned int segment, size_t size) {
+  Segment &s = segments_[segment];
+  extend(segment, size, size);
+  s.size = size;
+  store(segment);
+}
+} // namespace external_memory
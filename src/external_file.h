@@ -0,0 +1,288 @@
+//
+// Created by zj on 10/17/2026.
+//
+
+#ifndef BOOKSTORE_SRC_EXTERNAL_FILE_H_
+#define BOOKSTORE_SRC_EXTERNAL_FILE_H_
+
+#include <string>
+#include <vector>
+#include <sys/uio.h>
+
+namespace external_memory {
+/**
+ * @brief The way a file is accessed.
+ */
+enum class Backend {
+  kPositioned, // through pread and pwrite, every access is a single system call
+  kMmap // through a shared memory mapping of the whole file
+};
+#ifdef EXTERNAL_MEMORY_MMAP
+constexpr Backend kDefaultBackend = Backend::kMmap;
+#else
+constexpr Backend kDefaultBackend = Backend::kPositioned;
+#endif
+#ifdef EXTERNAL_MEMORY_TABLESPACE
+constexpr bool kDefaultUseTablespace = true;
+#else
+constexpr bool kDefaultUseTablespace = false;
+#endif
+class Tablespace;
+/**
+ * @brief A file of bytes, accessed by absolute positions.
+ *
+ * @details
+ * With `Backend::kMmap`, the whole file is mapped into memory, and `data` gives direct access to it.
+ * The file is grown with `fallocate`, and the mapping is grown with `mremap`.
+ * The mapping reserves more address space than the file size, so that it is not remapped on every growth.
+ *
+ * With `Backend::kPositioned`, every access is a positioned system call (`pread`, `pwrite`, `preadv`, `pwritev`, `copy_file_range`).
+ * There is no shared file offset and no user space buffering, so `read` may be called from several threads at once, and `flush` does nothing.
+ * `data` returns `nullptr`.
+ *
+ * If a `Tablespace` whose prefix matches the file name is mounted when the file is opened, the file becomes a segment of the tablespace.
+ * All accesses then go to the extents of the segment in the tablespace file, and the file itself is never created.
+ * A segment is not memory mapped by itself (its extents are not contiguous), even if the tablespace file is.
+ *
+ * @attention The pointer returned by `data` is invalidated when the file grows.
+ * @attention `open` must be called before using the file.
+ */
+class File {
+ private:
+  const std::string file_name_; // name (and path) of the file
+  Backend backend_; // the backend
+  int fd_ = -1; // the file descriptor
+  char *map_ = nullptr; // the mapping, only for Backend::kMmap
+  size_t map_capacity_ = 0; // the length of the mapping in bytes, only for Backend::kMmap
+  size_t size_ = 0; // the size of the file in bytes
+  Tablespace *tablespace_ = nullptr; // the tablespace that the file is a segment of, or nullptr
+  unsigned int segment_ = 0; // the index of the segment in the tablespace, only if tablespace_ is not nullptr
+  void map(size_t capacity); // map (or remap) the file with at least `capacity` bytes of address space
+ public:
+  /**
+   * @brief Construct a new File object.
+   * @param file_name The name (and path) of the file, including the extension.
+   * @param backend The backend.
+   */
+  explicit File(std::string file_name, Backend backend = kDefaultBackend)
+      : file_name_(std::move(file_name)), backend_(backend) {}
+  File(const File &) = delete;
+  File &operator=(const File &) = delete;
+  /**
+   * @brief Destroy the File object. The file is closed.
+   */
+  ~File();
+  /**
+   * @brief Open the file, creating it if it does not exist.
+   * @param reset Whether to truncate the file.
+   * @throw std::runtime_error If the file cannot be opened.
+   */
+  void open(bool reset = false);
+  /**
+   * @brief Close the file.
+   */
+  void close();
+  /**
+   * @brief Get the name (and path) of the file.
+   */
+  [[nodiscard]] const std::string &name() const { return file_name_; }
+  /**
+   * @brief Get the size of the file in bytes.
+   */
+  [[nodiscard]] size_t size() const { return size_; }
+  /**
+   * @brief Check whether the file is memory mapped.
+   */
+  [[nodiscard]] bool mapped() const { return backend_ == Backend::kMmap && !tablespace_; }
+  /**
+   * @brief Get the mapped content of the file.
+   * @return char* The beginning of the file, or `nullptr` if the file is not memory mapped.
+   * @attention The pointer is invalidated when the file grows.
+   */
+  [[nodiscard]] char *data() { return map_; }
+  /**
+   * @brief Read bytes from the file.
+   * @details Bytes beyond the end of the file are read as 0.
+   * @param pos The position to read from, in bytes.
+   * @param dest The destination.
+   * @param len The number of bytes.
+   */
+  void read(size_t pos, void *dest, size_t len);
+  /**
+   * @brief Write bytes to the file.
+   * @details The file grows if the bytes are written beyond its end.
+   * @param pos The position to write to, in bytes.
+   * @param src The source.
+   * @param len The number of bytes.
+   */
+  void write(size_t pos, const void *src, size_t len);
+  /**
+   * @brief Read consecutive bytes of the file into several buffers, like `preadv`.
+   * @details Bytes beyond the end of the file are read as 0.
+   * @param pos The position to read from, in bytes.
+   * @param iov The buffers, filled in order.
+   * @param count The number of buffers.
+   */
+  void readv(size_t pos, const iovec *iov, int count);
+  /**
+   * @brief Write several buffers to consecutive bytes of the file, like `pwritev`.
+   * @details The file grows if the bytes are written beyond its end.
+   * @param pos The position to write to, in bytes.
+   * @param iov The buffers, written in order.
+   * @param count The number of buffers.
+   */
+  void writev(size_t pos, const iovec *iov, int count);
+  /**
+   * @brief Copy bytes within the file.
+   * @details The file grows if the bytes are written beyond its end.
+   * @param src The position to copy from, in bytes.
+   * @param dest The position to copy to, in bytes.
+   * @param len The number of bytes.
+   * @attention The ranges must not overlap.
+   */
+  void copy(size_t src, size_t dest, size_t len);
+  /**
+   * @brief Change the size of the file.
+   * @details New bytes are 0.
+   * @param size The new size in bytes.
+   */
+  void resize(size_t size);
+  /**
+   * @brief Make sure that the file is at least `size` bytes long.
+   * @param size The minimum size in bytes.
+   */
+  void reserve(size_t size);
+  /**
+   * @brief Make sure that the disk space for the first `size` bytes is allocated, growing the file if necessary.
+   * @details Writing to allocated space does not fail for lack of disk space, which matters most for mapped files.
+   * @param size The minimum size in bytes.
+   * @throw std::runtime_error If the space cannot be allocated.
+   */
+  void allocate(size_t size);
+  /**
+   * @brief Hand the buffered writes over to the operating system.
+   * @details Writes are not buffered in user space, so this does nothing.
+   */
+  void flush() {}
+  /**
+   * @brief Write the content of the file to the disk (`fdatasync`, or `msync` for mapped files).
+   */
+  void sync();
+};
+
+/**
+ * @brief A single file holding the content of many `File`s, called segments.
+ *
+ * @details
+ * The tablespace file `<prefix>_tablespace.db` begins with a superblock of `kSuperblockSize` bytes, followed by extents.
+ * The superblock holds a header (magic number, version, number of segments) and one entry per segment:
+ * the name of the segment (the file name without the prefix), its size in bytes, and the positions of its extents.
+ *
+ * The extents of a segment double in size: extent k holds `kExtentSize << k` bytes, and covers the positions
+ * from `kExtentSize * (2^k - 1)` of the segment. New extents are appended to the end of the tablespace file.
+ * Extents are never returned: a segment that is truncated or shrunk keeps them for its later growth.
+ *
+ * The entry of a segment is written as soon as its size or extents change, so the superblock is as current as
+ * the sizes of separate files would be, and a backup of the database is a copy of one file.
+ *
+ * While the tablespace is mounted (between `open` and `close`), every `File` whose name starts with the prefix
+ * is opened as a segment. All segments share the file descriptor (and the mapping) of the tablespace file.
+ *
+ * @attention The tablespace must be closed after all of its segments.
+ */
+class Tablespace {
+ public:
+  static constexpr size_t kSuperblockSize = 16384; // the size of the superblock in bytes
+  static constexpr size_t kExtentSize = 65536; // the size of the first extent of a segment in bytes
+  static constexpr unsigned int kMaxSegments = 32; // the maximum number of segments
+  static constexpr unsigned int kMaxExtents = 32; // the maximum number of extents of a segment
+  static constexpr unsigned int kMaxNameLength = 48; // the maximum length of the name of a segment, including '\0'
+ private:
+  static constexpr unsigned int kMagic = 0x53544b42; // "BKTS"
+  static constexpr unsigned int kVersion = 1; // the version of the layout of the superblock
+  static constexpr size_t kHeaderSize = 16; // magic, version, number of segments and padding
+  static constexpr size_t kEntrySize = kMaxNameLength + 16 + kMaxExtents * 8; // name, size, number of extents and padding, extents
+  static_assert(kHeaderSize + kMaxSegments * kEntrySize <= kSuperblockSize);
+  struct Segment {
+    std::string name; // the file name without the prefix
+    size_t size = 0; // the size in bytes
+    std::vector<size_t> extents; // the positions of the extents in the tablespace file
+  };
+  static inline std::vector<Tablespace *> mounted_; // the mounted tablespaces
+  const std::string prefix_; // the prefix (and path) of the files stored in the tablespace
+  File file_; // the tablespace file
+  std::vector<Segment> segments_; // the segments
+  void store(unsigned int segment); // write the entry of a segment to the superblock
+  void extend(unsigned int segment, size_t size, size_t written); // make sure the extents of a segment cover `size` bytes, and zero its bytes after the end before `written`
+  void transfer(unsigned int segment, size_t pos, const iovec *iov, int count, bool write); // no bound checking
+  static size_t capacity(size_t extents) { return kExtentSize * ((size_t(1) << extents) - 1); }
+ public:
+  /**
+   * @brief Construct a new Tablespace object.
+   * @param prefix The prefix (and path) of the files stored in the tablespace.
+   * @param backend The backend of the tablespace file.
+   */
+  explicit Tablespace(std::string prefix, Backend backend = kDefaultBackend)
+      : prefix_(std::move(prefix)), file_(prefix_ + "_tablespace.db", backend) {}
+  Tablespace(const Tablespace &) = delete;
+  Tablespace &operator=(const Tablespace &) = delete;
+  /**
+   * @brief Destroy the Tablespace object. The tablespace is closed.
+   */
+  ~Tablespace();
+  /**
+   * @brief Open the tablespace file, creating it if it does not exist, and mount the tablespace.
+   * @param reset Whether to drop all the segments.
+   * @throw std::runtime_error If the file cannot be opened or is not a tablespace.
+   */
+  void open(bool reset = false);
+  /**
+   * @brief Unmount the tablespace and close the tablespace file.
+   */
+  void close();
+  /**
+   * @brief Get the name (and path) of the tablespace file.
+   */
+  [[nodiscard]] const std::string &name() const { return file_.name(); }
+  /**
+   * @brief Find the mounted tablespace that a file belongs to.
+   * @param file_name The name (and path) of the file.
+   * @return Tablespace* The tablespace, or `nullptr` if there is none.
+   */
+  [[nodiscard]] static Tablespace *find(const std::string &file_name);
+  /**
+   * @brief Open the segment of a file, creating it if it does not exist.
+   * @param file_name The name (and path) of the file.
+   * @param reset Whether to truncate the segment.
+   * @return unsigned int The index of the segment.
+   * @throw std::runtime_error If there are too many segments or the name is too long.
+   */
+  unsigned int segment(const std::string &file_name, bool reset);
+  /**
+   * @brief Get the size of a segment in bytes.
+   */
+  [[nodiscard]] size_t size(unsigned int segment) const { return segments_[segment].size; }
+  /**
+   * @brief Read consecutive bytes of a segment, see `File::readv`.
+   */
+  void readv(unsigned int segment, size_t pos, const iovec *iov, int count);
+  /**
+   * @brief Write consecutive bytes of a segment, see `File::writev`.
+   */
+  void writev(unsigned int segment, size_t pos, const iovec *iov, int count);
+  /**
+   * @brief Copy bytes within a segment, see `File::copy`.
+   */
+  void copy(unsigned int segment, size_t src, size_t dest, size_t len);
+  /**
+   * @brief Change the size of a segment, see `File::resize`.
+   */
+  void resize(unsigned int segment, size_t size);
+  /**
+   * @brief Write the content of the tablespace file to the disk.
+   */
+  void sync() { file_.sync(); }
+};
+} // namespace external_memory
+
+#endif //BOOKSTORE_SRC_EXTERNAL_FILE_H_
@@ -2,6 +2,7 @@
 // Created by zj on 11/29/2023.
 //
 
+#include <cstring>
 #include <iostream>
 #include "external_hash_map.h"
 namespace external_memory {
@@ -12,18 +13,90 @@ Hash_t Hash::splitmix64(Hash_t x) {
   x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
   return x ^ (x >> 31);
 }
-Hash_t Hash::operator()(const std::string &str) {
+Hash_t Hash::fmix64(Hash_t x) {
+  // Reference: https://github.com/aappleby/smhasher/blob/master/src/MurmurHash3.cpp
+  x = (x ^ (x >> 33)) * 0xff51afd7ed558ccd;
+  x = (x ^ (x >> 33)) * 0xc4ceb9fe1a85ec53;
+  return x ^ (x >> 33);
+}
+Hash_t Hash::unsplitmix64(Hash_t x) {
+  x ^= (x >> 31) ^ (x >> 62);
+  x *= 0x319642b2d24d8ec3; // the inverse of 0x94d049bb133111eb modulo 2^64
+  x ^= (x >> 27) ^ (x >> 54);
+  x *= 0x96de1b173f119089; // the inverse of 0xbf58476d1ce4e5b9 modulo 2^64
+  x ^= (x >> 30) ^ (x >> 60);
+  return x - 0x9e3779b97f4a7c15;
+}
+Fingerprint Hash::fingerprint(const std::string &str) {
   /// compute the hash every 8 characters to increase the speed
-  return std::hash<std::string>()(str);
-  Hash_t hash = 0;
-  unsigned int i = 0;
+  Hash_t hash = str.size(), check = ~hash;
+  auto step = [&hash, &check](Hash_t word) {
+    hash = (hash ^ word) * kHashMultiplier;
+    hash ^= hash >> 32;
+    check = (check ^ word) * kCheckMultiplier;
+    check ^= check >> 29;
+  };
+  size_t i = 0;
   for (; i + 8 <= str.size(); i += 8) {
-    hash = splitmix64(hash ^ *reinterpret_cast<const Hash_t *>(str.data() + i));
+    Hash_t word;
+    memcpy(&word, str.data() + i, sizeof(Hash_t));
+    step(word);
   }
-  for (; i < str.size(); ++i) {
-    hash = splitmix64(hash ^ str[i]);
+  if (i < str.size()) { // the remaining characters are padded with zeros
+    Hash_t word = 0;
+    for (size_t j = str.size(); j-- > i;) word = word << 8 | static_cast<unsigned char>(str[j]);
+    step(word);
   }
-  return hash;
+  return {splitmix64(hash), static_cast<unsigned int>(fmix64(check) >> 32)};
+}
+Hash_t Hash::operator()(const std::string &str) {
+  return fingerprint(str).hash;
+}
+unsigned int Hash::check(const std::string &str) {
+  return fingerprint(str).check;
+}
+template<class Function>
+void Filter::probe(const Fingerprint &key, Function function) {
+  auto index = static_cast<unsigned int>(key.hash >> 32), step = key.check | 1; // an odd step visits every counter
+  for (unsigned int i = 0; i < kProbes; ++i, index += step) {
+    unsigned int counter = index & mask_;
+    function(counter >> 3, (counter & 7) << 2);
+  }
+}
+void Filter::initialize(bool reset) {
+  counters_.initialize(reset);
+  counters_.cache();
+  mask_ = counters_.size() ? (counters_.size() << 3) - 1 : 0;
+}
+void Filter::reset(unsigned int capacity) {
+  counters_.resize(0);
+  counters_.resize(std::bit_ceil(capacity * kCountersPerKey) >> 3);
+  mask_ = (counters_.size() << 3) - 1;
+}
+bool Filter::sizedFor(unsigned int capacity) const {
+  return counters_.size() == std::bit_ceil(capacity * kCountersPerKey) >> 3;
+}
+void Filter::add(const Fingerprint &key) {
+  probe(key, [this](unsigned int n, unsigned int shift) {
+    auto value = static_cast<unsigned int>(counters_.get(n));
+    if (((value >> shift) & kMaxCount) != kMaxCount) counters_.set(n, static_cast<int>(value + (1u << shift)));
+  });
+}
+void Filter::remove(const Fingerprint &key) {
+  probe(key, [this](unsigned int n, unsigned int shift) {
+    auto value = static_cast<unsigned int>(counters_.get(n));
+    if (((value >> shift) & kMaxCount) != kMaxCount) counters_.set(n, static_cast<int>(value - (1u << shift)));
+  });
+}
+bool Filter::mayContain(const Fingerprint &key) {
+  bool contained = true;
+  probe(key, [this, &contained](unsigned int n, unsigned int shift) {
+    contained &= ((static_cast<unsigned int>(counters_.get(n)) >> shift) & kMaxCount) != 0;
+  });
+  return contained;
+}
+void Filter::checkpoint() {
+  counters_.checkpoint();
 }
 template<class Key>
 Hash_t Map<Key>::Bucket::getLocalHighBit(const Hash_t &key) const {
@@ -35,33 +108,73 @@ Map<Key>::Bucket::Bucket(Map &map, unsigned int id) : map(map), id(id) {
     local_depth = 0;
     return;
   }
-  Page tmp;
-  map.data_.getPage(id, tmp);
-  local_depth = tmp[0] >> 16;
-  unsigned int size = tmp[0] & ((1 << 16) - 1);
-  for (unsigned int i = 0; i < size; ++i) {
-    Hash_t key = *reinterpret_cast<Hash_t *>(tmp + i * 3 + 1);
-    int value = tmp[i * 3 + 3];
-    data.insert(data.end(), {key, value});
-  }
+  map.data_.getPage(id, page);
+  local_depth = page[0] >> 16;
+  count = page[0] & ((1 << 16) - 1);
+  next = page[1];
 }
 template<class Key>
-void Map<Key>::Bucket::flush() const {
+void Map<Key>::Bucket::flush() {
   if (!id) return;
-  Page tmp;
-  memset(tmp, 0, sizeof(tmp));
-  tmp[0] = (local_depth << 16) | data.size();
-  unsigned int i = 0;
-  for (auto &pair : data) {
-    *reinterpret_cast<Hash_t *>(tmp + i * 3 + 1) = pair.first;
-    tmp[i * 3 + 3] = static_cast<int>(pair.second);
-    ++i;
+  int header = static_cast<int>((local_depth << 16) | count);
+  if (!dirty && page[0] == header && page[1] == static_cast<int>(next)) return;
+  page[0] = header;
+  page[1] = static_cast<int>(next);
+  page[2] = page[3] = 0;
+  memset(page + kHeaderSize + count * 4, 0, (kIntegerPerPage - kHeaderSize - count * 4) * sizeof(int));
+  map.data_.setPage(id, page);
+  dirty = false;
+}
+template<class Key>
+Fingerprint Map<Key>::fingerprintAt(const int *page, unsigned int i) {
+  Fingerprint fingerprint{};
+  memcpy(&fingerprint.hash, page + kHeaderSize + i * 4, sizeof(Hash_t));
+  memcpy(&fingerprint.check, page + kHeaderSize + i * 4 + 2, sizeof(unsigned int));
+  return fingerprint;
+}
+template<class Key>
+unsigned int Map<Key>::lowerBound(const int *page, unsigned int count, const Fingerprint &key) {
+  unsigned int low = 0, high = count;
+  while (low < high) {
+    unsigned int mid = (low + high) >> 1;
+    if (fingerprintAt(page, mid) < key) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
   }
-  map.data_.setPage(id, tmp);
+  return low;
+}
+template<class Key>
+const unsigned int *Map<Key>::findInPage(const int *page, unsigned int count, const Fingerprint &key) {
+  unsigned int i = lowerBound(page, count, key);
+  if (i == count || fingerprintAt(page, i) != key) return nullptr;
+  return reinterpret_cast<const unsigned int *>(page + kHeaderSize + i * 4 + 3);
 }
 template<class Key>
-Map<Key>::Bucket::Bucket(Map<Key>::Bucket &&bucket) noexcept
-    : map(bucket.map), id(bucket.id), local_depth(bucket.local_depth), data(std::move(bucket.data)) {
+Fingerprint Map<Key>::Bucket::fingerprintAt(unsigned int i) const {
+  return Map<Key>::fingerprintAt(page, i);
+}
+template<class Key>
+unsigned int &Map<Key>::Bucket::valueAt(unsigned int i) {
+  return reinterpret_cast<unsigned int &>(page[kHeaderSize + i * 4 + 3]);
+}
+template<class Key>
+unsigned int Map<Key>::Bucket::lowerBound(const Fingerprint &key) const {
+  return Map<Key>::lowerBound(page, count, key);
+}
+template<class Key>
+void Map<Key>::Bucket::assign(const Bucket &bucket) {
+  id = bucket.id;
+  local_depth = bucket.local_depth;
+  next = bucket.next;
+  count = bucket.count;
+  dirty = bucket.dirty;
+  memcpy(page, bucket.page, (kHeaderSize + count * 4) * sizeof(int));
+}
+template<class Key>
+Map<Key>::Bucket::Bucket(Map<Key>::Bucket &&bucket) noexcept : map(bucket.map) {
+  assign(bucket);
   bucket.id = 0;
 }
 template<class Key>
@@ -70,9 +183,7 @@ typename Map<Key>::Bucket &Map<Key>::Bucket::operator=(Map::Bucket &&bucket) noe
     return *this;
   }
   flush();
-  id = bucket.id;
-  local_depth = bucket.local_depth;
-  data = std::move(bucket.data);
+  assign(bucket);
   bucket.id = 0;
   return *this;
 }
@@ -82,58 +193,97 @@ Map<Key>::Bucket::~Bucket() {
 }
 template<class Key>
 unsigned int Map<Key>::Bucket::size() const {
-  return data.size();
+  return count;
 }
 template<class Key>
 bool Map<Key>::Bucket::full() const {
-  return data.size() >= kPairsPerPage;
+  return count >= kPairsPerPage;
 }
 template<class Key>
-bool Map<Key>::Bucket::contains(const Hash_t &key) const {
-  return data.contains(key);
+bool Map<Key>::Bucket::contains(const Fingerprint &key) const {
+  return find(key) != nullptr;
 }
 template<class Key>
-bool Map<Key>::Bucket::insert(const Hash_t &key, unsigned int value) {
-  return data.insert({key, value}).second;
+bool Map<Key>::Bucket::insert(const Fingerprint &key, unsigned int value) {
+  unsigned int i = lowerBound(key);
+  if (i < count && fingerprintAt(i) == key) return false;
+  int *slot = page + kHeaderSize + i * 4;
+  memmove(slot + 4, slot, (count - i) * 4 * sizeof(int));
+  memcpy(slot, &key.hash, sizeof(Hash_t));
+  memcpy(slot + 2, &key.check, sizeof(unsigned int));
+  valueAt(i) = value;
+  ++count;
+  dirty = true;
+  return true;
 }
 template<class Key>
-bool Map<Key>::Bucket::erase(const Hash_t &key) {
-  size_t size_before = data.size();
-  data.erase(key);
-  return data.size() < size_before;
+bool Map<Key>::Bucket::erase(const Fingerprint &key) {
+  unsigned int i = lowerBound(key);
+  if (i == count || fingerprintAt(i) != key) return false;
+  int *slot = page + kHeaderSize + i * 4;
+  memmove(slot, slot + 4, (count - i - 1) * 4 * sizeof(int));
+  --count;
+  dirty = true;
+  return true;
 }
 template<class Key>
-std::map<Hash_t, unsigned int>::const_iterator Map<Key>::Bucket::find(const Hash_t &key) const {
-  return data.find(key);
-}
-template<class Key>
-std::map<Hash_t, unsigned int>::const_iterator Map<Key>::Bucket::end() const {
-  return data.end();
+const unsigned int *Map<Key>::Bucket::find(const Fingerprint &key) const {
+  return findInPage(page, count, key);
 }
 template<class Key>
 Map<Key>::Bucket Map<Key>::Bucket::split() {
   Bucket ret(map);
-  for (auto it = data.begin(); it != data.end();) {
-    if (getLocalHighBit(it->first)) {
-      ret.data.insert(ret.data.end(), *it);
-      it = data.erase(it);
-    } else {
-      ++it;
-    }
+  unsigned int kept = 0;
+  for (unsigned int i = 0; i < count; ++i) { // both halves stay sorted
+    int *target = getLocalHighBit(fingerprintAt(i).hash) ? ret.page + kHeaderSize + ret.count++ * 4
+                                                          : page + kHeaderSize + kept++ * 4;
+    memmove(target, page + kHeaderSize + i * 4, 4 * sizeof(int));
   }
+  count = kept;
+  dirty = ret.dirty = true;
   ret.local_depth = ++local_depth;
   return ret;
 }
 template<class Key>
+void Map<Key>::Bucket::fill(const std::pair<Fingerprint, unsigned int> *pairs, unsigned int size) {
+  for (unsigned int i = 0; i < size; ++i) {
+    memcpy(page + kHeaderSize + i * 4, &pairs[i].first.hash, sizeof(Hash_t));
+    memcpy(page + kHeaderSize + i * 4 + 2, &pairs[i].first.check, sizeof(unsigned int));
+    valueAt(i) = pairs[i].second;
+  }
+  count = size;
+  dirty = true;
+}
+template<class Key>
+void Map<Key>::Bucket::absorb(const Bucket &bucket) {
+  Page merged;
+  unsigned int i = 0, j = 0, k = 0;
+  for (; i < count || j < bucket.count; ++k) { // both are sorted, and their fingerprints are distinct
+    bool own = j == bucket.count || (i < count && fingerprintAt(i) < bucket.fingerprintAt(j));
+    const int *source = own ? page + kHeaderSize + i++ * 4 : bucket.page + kHeaderSize + j++ * 4;
+    memcpy(merged + kHeaderSize + k * 4, source, 4 * sizeof(int));
+  }
+  memcpy(page + kHeaderSize, merged + kHeaderSize, k * 4 * sizeof(int));
+  count = k;
+  dirty = true;
+}
+template<class Key>
 bool Map<Key>::Bucket::empty() const {
-  return data.empty();
+  return count == 0;
 }
 template<class Key>
-unsigned int &Map<Key>::Bucket::operator[](const Hash_t &key) {
-  return data[key];
+unsigned int &Map<Key>::Bucket::operator[](const Fingerprint &key) {
+  unsigned int i = lowerBound(key);
+  if (i == count || fingerprintAt(i) != key) insert(key, 0);
+  dirty = true; // the value may be modified through the reference
+  return valueAt(i);
 }
 template
 class Map<std::string>;
 template
+class Map<unsigned int>;
+template
+class Map<unsigned long long>;
+template
 class MultiMap<std::string>;
 } // namespace external_memory
@@ -5,27 +5,137 @@
 #ifndef BOOKSTORE_SRC_EXTERNAL_HASH_MAP_H_
 #define BOOKSTORE_SRC_EXTERNAL_HASH_MAP_H_
 
-#include <map>
+#include <bit>
+#include <concepts>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <thread>
+#include <tuple>
 #include "external_memory.h"
 #include "external_vector.h"
 
 namespace external_memory {
 using Hash_t = unsigned long long;
+/**
+ * @brief A fingerprint of a key: its hash, and a check computed by an independent hash function.
+ * @details Two keys are treated as equal if their fingerprints are equal, so a silent collision needs 96 equal bits.
+ */
+struct Fingerprint {
+  Hash_t hash; // the hash, which decides the bucket
+  unsigned int check; // the independent check
+  auto operator<=>(const Fingerprint &) const = default;
+};
 /**
  * @brief A hash function that maps a string to a 64-bit unsigned integer.
- * @details The hash function is based on splitmix64.
+ * @details The hash function is based on splitmix64, and the check on the finalizer of MurmurHash3.
+ * @details Hashes are stored in files, so the functions must not change without changing `kVersion`.
+ * @details Version 1: the string is read 8 characters at a time as little-endian 64-bit words, the last word padded
+ * with zeros. The hash starts as the length of the string, and each word w updates it by h = (h ^ w) * kHashMultiplier,
+ * h ^= h >> 32; the result is splitmix64(h). The check starts as the complement of the length, and each word updates it
+ * by c = (c ^ w) * kCheckMultiplier, c ^= c >> 29; the result is the high 32 bits of fmix64(c).
+ * An integral key k, converted to 64 bits, has the hash splitmix64(k) and the check the high 32 bits of fmix64(k).
+ * splitmix64 is a bijection, so distinct integral keys never collide, and `key` recovers k from its hash.
  * @see http://xorshift.di.unimi.it/splitmix64.c
+ * @see https://github.com/aappleby/smhasher/blob/master/src/MurmurHash3.cpp
  */
 class Hash {
  private:
+  static constexpr Hash_t kHashMultiplier = 0x9e3779b97f4a7c15; // odd, so that the word step is invertible
+  static constexpr Hash_t kCheckMultiplier = 0xbf58476d1ce4e5b9; // odd, and different from kHashMultiplier
   static Hash_t splitmix64(Hash_t x);
+  static Hash_t fmix64(Hash_t x);
+  static Hash_t unsplitmix64(Hash_t x); // the inverse of splitmix64
+  static_assert(std::endian::native == std::endian::little, "The stored hashes assume a little-endian machine!");
+ public:
+  static constexpr int kVersion = 1; // the version of the hash function and the check, stored in the info page of a map
   /**
    * @brief The hash function for std::string.
    * @param str The string to be hashed.
    * @return The hash value.
    */
- public:
   Hash_t operator()(const std::string &str);
+  /**
+   * @brief The check of a string, independent of its hash.
+   */
+  unsigned int check(const std::string &str);
+  /**
+   * @brief The fingerprint of a string, i.e. its hash and its check, computed in a single pass.
+   */
+  Fingerprint fingerprint(const std::string &str);
+  /**
+   * @brief The fingerprint of an integral key, whose hash identifies the key exactly.
+   */
+  template<std::integral Integer>
+  Fingerprint fingerprint(Integer key) {
+    auto x = static_cast<Hash_t>(key);
+    return {splitmix64(x), static_cast<unsigned int>(fmix64(x) >> 32)};
+  }
+  /**
+   * @brief Recover an integral key from the hash of its fingerprint.
+   */
+  template<std::integral Integer>
+  static Integer key(Hash_t hash) { return static_cast<Integer>(unsplitmix64(hash)); }
+};
+/**
+ * @brief A counting Bloom filter of fingerprints, stored in a file.
+ * @details Each fingerprint is counted in `kProbes` 4-bit counters, 8 counters per integer of the file.
+ * The counters are chosen by double hashing of the high half of the hash and the check. The low bits of the hash,
+ * which choose the bucket of a `Map`, are not used.
+ * @details A counter that reaches 15 is never decremented, so removing a fingerprint never causes a false negative.
+ * @details There are `kCountersPerKey` counters (rounded up to a power of two) per fingerprint of the capacity,
+ * which gives a false positive rate of about 1% at full capacity.
+ * @attention `initialize` must be called before using the filter.
+ */
+class Filter {
+ private:
+  Array counters_; // the counters, 8 per integer
+  unsigned int mask_ = 0; // the number of counters minus 1
+  template<class Function>
+  void probe(const Fingerprint &key, Function function); // call function(integer, shift) for each counter of the key
+ public:
+  static constexpr unsigned int kCountersPerKey = 10; // the number of counters per fingerprint of the capacity
+  static constexpr unsigned int kProbes = 7; // the number of counters of a fingerprint
+  static constexpr unsigned int kMaxCount = 15; // a counter that reaches this count sticks
+  /**
+   * @brief Construct a new Filter object.
+   * @param file_name The name (and path) of the file, without the extension.
+   */
+  explicit Filter(std::string file_name) : counters_(std::move(file_name)) {}
+  /**
+   * @brief Open the file of the filter and cache it.
+   * @param reset Whether to truncate the file.
+   */
+  void initialize(bool reset = false);
+  /**
+   * @brief Empty the filter, and size it for `capacity` fingerprints.
+   */
+  void reset(unsigned int capacity);
+  /**
+   * @brief Check whether the file has the size of a filter for `capacity` fingerprints.
+   */
+  [[nodiscard]] bool sizedFor(unsigned int capacity) const;
+  /**
+   * @brief Add a fingerprint.
+   */
+  void add(const Fingerprint &key);
+  /**
+   * @brief Remove a fingerprint, which must have been added.
+   */
+  void remove(const Fingerprint &key);
+  /**
+   * @brief Check whether a fingerprint may have been added.
+   * @return false if the fingerprint has certainly not been added (or has been removed since).
+   */
+  [[nodiscard]] bool mayContain(const Fingerprint &key);
+  /**
+   * @brief Write the modified counters back to the file.
+   */
+  void checkpoint();
+  /**
+   * @brief Write the file to the disk, after `checkpoint`.
+   */
+  void sync() { counters_.sync(); }
 };
 /**
  * @brief A hash map that maps a key to an unsigned integer.
@@ -33,12 +143,25 @@ class Hash {
  * @see https://en.wikipedia.org/wiki/Extendible_hashing
  * @see https://www.geeksforgeeks.org/extendible-hashing-dynamic-approach-to-dbms/
  * @see https://dl.acm.org/doi/10.1145/320083.320092
- * @tparam Key The type of the key.
+ * @tparam Key The type of the key, std::string or an integral type.
  * @attention It's not recommended to store zero in the map, because the `at` method returns 0 if the key is not in the map.
  * @attention The key must be hashable, and the uniformity of the hash function is important.
- * @attention No collision handling is implemented! To avoid collision, it's recommended to insert less than 1e6 keys.
+ * @note Keys are identified by their fingerprints (a 64-bit hash and a 32-bit check), see `Fingerprint`.
+ * An integral key is identified by its hash alone, without collisions, and `key` recovers it from its fingerprint.
+ * @note When a full bucket cannot be split (its local depth is kMaxGlobalDepth), overflow pages are chained to it.
+ * @note After an erase, a bucket is merged into its buddy if they have the same local depth and few pairs together,
+ * and the directory is halved while no bucket has the global depth.
+ * @note The layout of the pages and the hash function are versioned in the info page, and a map of other versions cannot be opened.
+ * @note The directory is doubled without copying it: the new upper half starts as zeros. A zero entry stands for the
+ * entry whose index is its own index without the highest bit, and `kMigrationStep` of the zeros are replaced on each insert.
+ * No single insert pays for copying the whole directory, even if it doubles again before the zeros are all replaced.
+ * @note With `filter`, a `Filter` of the fingerprints answers most lookups and erases of absent keys without reading
+ * a bucket. It is rebuilt from the buckets with twice the capacity when the map outgrows it, and when the map was
+ * last used without the filter. `falsePositiveRate` measures how often it fails to answer.
  * @note The dictionary is cached in the memory.
- * @note The bucket containing the most recently accessed key is cached in the memory.
+ * @note Up to `bucket_count` recently used buckets are cached in the memory, and evicted in LRU order.
+ * @note A cached bucket is written back only if it has been modified.
+ * @note `at` only reads: it searches the pages of buckets that are not cached in place in the page cache, see `probe`.
  */
 template<class Key>
 class Map {
@@ -49,24 +172,51 @@ class Map {
   Pages data_; // the data
   int &size_ = data_.getInfo(1); // the size of the map
   int &global_depth_ = data_.getInfo(2); // the global depth of the directory
+  int &layout_ = data_.getInfo(3); // the version of the layout of the pages
+  int &hash_version_ = data_.getInfo(4); // the version of the hash function, see Hash::kVersion
+  int &migration_ = data_.getInfo(5); // the number of entries at the end of the directory that may still be zero, see expand
+  int &filter_capacity_ = data_.getInfo(6); // the number of keys that the filter is sized for, 0 if the filter is not up to date
+  static constexpr int kLayoutVersion = 1; // 12-byte pairs without check and overflow pages are version 0
   static constexpr unsigned int
-      kMaxGlobalDepth = 23; // If the global depth is larger than this value, the program will throw an exception.
+      kMaxGlobalDepth = 23; // Buckets are not split beyond this depth, overflow pages are chained instead.
   static constexpr unsigned int
-      kSizeOfPair = sizeof(Hash_t) + sizeof(unsigned int); // the size of a pair of key and value
+      kHeaderSize = 4; // the size of the header of a page, in integers: local depth << 16 | size, next overflow page, reserved
   static constexpr unsigned int
-      kPairsPerPage = (kPageSize - sizeof(unsigned short) * 2) / kSizeOfPair; // the number of pairs in a page
-  static_assert(kSizeOfPair == 12, "The size of a pair of key and value is not 12!");
+      kSizeOfPair = sizeof(Hash_t) + sizeof(unsigned int) * 2; // the size of a pair of fingerprint and value
+  static constexpr unsigned int
+      kPairsPerPage = (kPageSize - kHeaderSize * sizeof(int)) / kSizeOfPair; // the number of pairs in a page
+  static_assert(kSizeOfPair == 16, "The size of a pair of fingerprint and value is not 16!");
+  static constexpr unsigned int kMinBucketCount = 2; // a split needs the old and the new bucket at the same time
+  static constexpr unsigned int kMinFilterCapacity = 1024; // the capacity of the filter of an empty map
+  static constexpr unsigned int
+      kMigrationStep = 64; // the number of entries of the directory copied on each insert while the directory is migrated
+  static constexpr unsigned int
+      kMergeThreshold = kPairsPerPage * 3 / 4; // buddies are merged if they have at most this number of pairs together, below a full page so that they are not split again right away
 
   inline unsigned int getBucketId(const Hash_t &key); // get the id of the bucket that may contain the key
+  [[nodiscard]] static Fingerprint fingerprintAt(const int *page, unsigned int i); // the fingerprint of the i-th pair of a page image
+  [[nodiscard]] static unsigned int lowerBound(const int *page, unsigned int count, const Fingerprint &key); // see Bucket::lowerBound
+  [[nodiscard]] static const unsigned int *findInPage(const int *page, unsigned int count, const Fingerprint &key); // see Bucket::find
 
+  /**
+   * The bucket is kept as the image of its page: the header (see kHeaderSize) is followed by the pairs,
+   * sorted by fingerprint, each of which is a hash (two integers), a check and a value. Lookups are binary searches
+   * in the image, and the image is written back only if it has been modified.
+   * An overflow page has the same layout, and is cached as a bucket of its own.
+   */
   struct Bucket {
    private:
-    void flush() const; // flush the bucket to the disk
+    Page page; // the image of the page, only the first kHeaderSize + 4 * count integers are meaningful
+    unsigned int count = 0; // the number of pairs in the bucket
+    bool dirty = false; // whether the pairs have been modified since the page was read
+    [[nodiscard]] unsigned int &valueAt(unsigned int i); // the value of the i-th pair
+    [[nodiscard]] unsigned int lowerBound(const Fingerprint &key) const; // the index of the first pair whose fingerprint is not less than the key
+    void assign(const Bucket &bucket); // copy the pairs and the state of another bucket
    public:
     Map<Key> &map; // the map that the bucket belongs to
     unsigned int id = 0; // the id of the bucket, 0 means that the bucket is not initialized
     unsigned int local_depth = 0; // the local depth of the bucket
-    std::map<Hash_t, unsigned int> data;
+    unsigned int next = 0; // the id of the next overflow page, 0 if there is none
     Bucket(Map &map) : map(map) {};
     Bucket(Map &map, unsigned int id);
     Bucket(Bucket &&bucket) noexcept;
@@ -74,43 +224,88 @@ class Map {
     ~Bucket();
     explicit Bucket(const Bucket &bucket) = delete;
     Bucket &operator=(const Bucket &bucket) = delete;
+    [[nodiscard]] Fingerprint fingerprintAt(unsigned int i) const; // the fingerprint of the i-th pair
+    void flush(); // flush the bucket to the disk, if it has been modified
     [[nodiscard]] Hash_t getLocalHighBit(const Hash_t &key) const;
     [[nodiscard]] unsigned int size() const;
     [[nodiscard]] bool full() const; // remember that inserting to a full bucket is possible when the key is already in the bucket!
     [[nodiscard]] bool empty() const;
-    [[nodiscard]] bool contains(const Hash_t &key) const;
-    [[nodiscard]] unsigned int &operator[](const Hash_t &key); // using this method to insert into a full bucket is undefined!
-    bool insert(const Hash_t &key, unsigned int value);
-    bool erase(const Hash_t &key);
-    [[nodiscard]] std::map<Hash_t, unsigned int>::const_iterator find(const Hash_t &key) const;
-    [[nodiscard]] std::map<Hash_t, unsigned int>::const_iterator end() const;
+    [[nodiscard]] bool contains(const Fingerprint &key) const;
+    [[nodiscard]] unsigned int &operator[](const Fingerprint &key); // using this method to insert into a full bucket is undefined!
+    bool insert(const Fingerprint &key, unsigned int value);
+    bool erase(const Fingerprint &key);
+    [[nodiscard]] const unsigned int *find(const Fingerprint &key) const; // the value of the key, or nullptr if the key is not in the bucket
     [[nodiscard]] Bucket split(); // the id of the new bucket is not set!
+    void fill(const std::pair<Fingerprint, unsigned int> *pairs, unsigned int size); // replace the pairs with sorted distinct pairs
+    void absorb(const Bucket &bucket); // add the pairs of another bucket, which must fit
   };
 
-  Bucket cache_ = {*this};
+  const unsigned int bucket_count_; // the maximum number of cached buckets
+  std::list<Bucket> cache_; // the cached buckets, the most recently used bucket comes first
+  std::unordered_map<unsigned int, typename std::list<Bucket>::iterator> cached_; // bucket id -> position in cache_
+  const bool use_filter_; // whether the map has a filter
+  Filter filter_; // the filter of the fingerprints, only if use_filter_
+  unsigned long long filtered_ = 0; // the number of lookups of absent keys answered by the filter
+  unsigned long long false_positives_ = 0; // the number of lookups of absent keys not answered by the filter
 
-  void flush(); // flush the Bucket cache to the disk. The dictionary is not flushed.
+  void flush(); // flush the modified cached buckets to the disk, they stay cached. The dictionary is not flushed.
   /**
    * @brief Get the bucket that contains the key.
    * @details
-   *    Returns the reference to cache_ if the bucket is cached.
-   *    Otherwise, fetch the bucket from the disk and return the reference to cache_.
-   * @attention If getBucket is called with another key, the reference to cache_ will be changed.
-   * @attention Other methods may change the reference to cache_.
+   *    Returns the cached bucket if there is one, and marks it as the most recently used.
+   *    Otherwise, fetch the bucket from the disk into the least recently used cache entry, which is written back first.
+   * @attention The reference is invalidated when the bucket is evicted, i.e. after `bucket_count` other buckets are fetched.
    */
   Bucket &getBucket(const Hash_t &key);
-  unsigned int splitBucket(const Hash_t &key); // return the id of the new bucket, cache_ is set to the bucket that may contain the key
-  void deleteBucket(const Hash_t &key); // delete an empty bucket, cache_ is cleared
-  void expand();
-  void insertByHash(const Hash_t &key, unsigned int value);
-  void eraseByHash(const Hash_t &key);
+  Bucket &fetchBucket(unsigned int bucket_id); // get the bucket (or overflow page) by id, see getBucket
+  /**
+   * @brief Find the page (the bucket or one of its overflow pages) that contains the key.
+   * @param key The fingerprint of the key.
+   * @param prev Set to the page before the found page in the chain, or nullptr if the found page is the bucket itself.
+   * @return Bucket* The page, or nullptr if the key is not in the map.
+   * @attention Only the returned page and `prev` stay valid.
+   */
+  Bucket *findBucket(const Fingerprint &key, Bucket **prev = nullptr);
+  /**
+   * @brief Get the value of the key without modifying anything, see `at`.
+   * @details Cached buckets are searched in the cache. The other pages are searched in place in the page cache of
+   * `data_`, without being copied into a `Bucket`, so a lookup never evicts (and writes back) a cached bucket.
+   * @return unsigned int The value, or 0 if the key is not in the map.
+   */
+  [[nodiscard]] unsigned int probe(const Fingerprint &key);
+  unsigned int splitBucket(const Hash_t &key); // return the id of the new bucket, both halves stay cached
+  void mergeBucket(const Hash_t &key); // merge the bucket into its buddy while they have the same local depth and few pairs, see kMergeThreshold
+  void shrink(); // halve the directory while no bucket has the global depth
+  void dropBucket(Bucket &bucket); // delete the page of a cached bucket without writing it back, and drop it from the cache
+  std::vector<unsigned int> bucketIds(); // the ids of all buckets (without overflow pages), sorted
+  std::vector<unsigned int> pageIds(); // the ids of all pages of the buckets (with overflow pages), sorted, after writing the cached buckets back
+  void rebuildFilter(unsigned int capacity); // refill the filter from the buckets
+  void added(const Fingerprint &key); // count a newly inserted key, and add it to the filter
+  [[nodiscard]] bool filtered(const Fingerprint &key); // whether the filter tells that the key is absent
+  void expand(); // double the directory, the upper half is migrated by `migrate` later
+  void migrate(unsigned int count); // replace up to `count` zeros in the directory, lowest index first
+  /**
+   * @brief Write the buckets of sorted distinct pairs, splitting them by the bits of their hashes from `depth` on.
+   * @param prefix The common low `depth` bits of the hashes.
+   * @param buckets Filled with the (local depth, prefix, id) of each written bucket.
+   */
+  void buildBuckets(std::pair<Fingerprint, unsigned int> *begin, std::pair<Fingerprint, unsigned int> *end,
+                    unsigned int depth, Hash_t prefix,
+                    std::vector<std::tuple<unsigned int, Hash_t, unsigned int>> &buckets);
+  void insertByHash(const Fingerprint &key, unsigned int value);
+  void eraseByHash(const Fingerprint &key);
 
  public:
+  static constexpr unsigned int kDefaultBucketCount = 64; // the default number of cached buckets
   /**
    * @brief Construct a new Map object.
+   * @param file_name The prefix (and path) of the files of the map.
+   * @param bucket_count The maximum number of cached buckets, at least 2.
+   * @param filter Whether to keep a filter of the keys in front of the buckets, in the file `file_name + "_filter"`.
    */
-  explicit Map(std::string file_name = "map")
-      : file_name_(std::move(file_name)), dict_(file_name_ + "_dict"), data_(file_name_ + "_data") {};
+  explicit Map(std::string file_name = "map", unsigned int bucket_count = kDefaultBucketCount, bool filter = false)
+      : file_name_(std::move(file_name)), dict_(file_name_ + "_dict"), data_(file_name_ + "_data"),
+        bucket_count_(std::max(bucket_count, kMinBucketCount)), use_filter_(filter), filter_(file_name_ + "_filter") {};
   /**
    * @brief Destroy the Map object.
    */
@@ -126,6 +321,16 @@ class Map {
    * @param value The value.
    */
   void insert(const Key &key, unsigned int value);
+  /**
+   * @brief Insert many key-value pairs into an empty map.
+   * @details All keys are hashed and sorted at once, and the local depth of each bucket is decided from the number
+   * of keys that share its prefix, so that every bucket page is written once and the directory is resized once.
+   * @details As with `insert`, only the first value of a duplicated key is kept.
+   * @details If the map is not empty, the pairs are inserted one by one.
+   * @param pairs A range of (key, value) pairs.
+   */
+  template<class Range>
+  void bulkLoad(const Range &pairs);
   /**
    * @brief Get the value of the key. If the key is not in the map, insert the key with value 0.
    * @param key The key.
@@ -144,6 +349,15 @@ class Map {
    * @return The value of the key. If the key is not in the map, return 0.
    */
   [[nodiscard]] unsigned int at(const Key &key);
+  /**
+   * @brief Write all cached data (the bucket, the pages and the directory) back to the files.
+   * @details The map stays usable, and the directory stays cached.
+   */
+  void checkpoint();
+  /**
+   * @brief Write the files to the disk, after `checkpoint`.
+   */
+  void sync();
   /**
    * @brief Get the size of the map.
    * @return The size of the map.
@@ -154,8 +368,141 @@ class Map {
    * @return The global depth of the directory.
    */
   [[nodiscard]] unsigned int globalDepth() const;
+  /**
+   * @brief Get the measured false positive rate of the filter.
+   * @return The fraction of the lookups (`at` and `erase`) of absent keys that the filter did not answer,
+   * since the map was constructed. 0 if there has been none, or if the map has no filter.
+   */
+  [[nodiscard]] double falsePositiveRate() const;
+  /**
+   * @brief A forward iterator over the (fingerprint, value) pairs of a map.
+   * @details The pages of the buckets and their overflow pages are visited once each, in the order of their ids,
+   * which is their order in the file, however many entries of the directory point to them.
+   * @details A default constructed iterator is the end iterator.
+   * @attention The iterator is invalidated when the map is modified.
+   */
+  class Iterator {
+   private:
+    static constexpr size_t kEnd = static_cast<size_t>(-1); // the page index of the end iterator
+    Map *map_ = nullptr; // the map
+    std::shared_ptr<const std::vector<unsigned int>> pages_; // the ids of the pages to visit, sorted
+    size_t page_index_ = kEnd; // the index of the current page in pages_, kEnd at the end
+    unsigned int pair_ = 0; // the index of the current pair in the current page
+    unsigned int count_ = 0; // the number of pairs in the current page
+    Page page_{}; // the image of the current page
+    void load(); // load the current page, or the first non-empty page after it
+   public:
+    using iterator_concept = std::forward_iterator_tag;
+    using iterator_category = std::input_iterator_tag; // the pairs are returned by value
+    using value_type = std::pair<Fingerprint, unsigned int>;
+    using difference_type = std::ptrdiff_t;
+    Iterator() = default;
+    Iterator(Map &map, std::shared_ptr<const std::vector<unsigned int>> pages);
+    value_type operator*() const;
+    Iterator &operator++();
+    Iterator operator++(int);
+    bool operator==(const Iterator &other) const { return page_index_ == other.page_index_ && pair_ == other.pair_; }
+  };
+  /**
+   * @brief Get an iterator to the first pair of the map.
+   * @details The modified cached buckets are written back to the page cache first.
+   */
+  Iterator begin();
+  /**
+   * @brief Get the end iterator.
+   */
+  Iterator end() { return Iterator(); }
+  /**
+   * @brief Call `function(fingerprint, value)` for every pair of the map, from several threads.
+   * @details The pages (see `Iterator`) are split into `thread_count` runs of consecutive pages. Each thread reads
+   * its run directly from the file, after the page cache has been written back, and calls the function.
+   * @param thread_count The number of threads.
+   * @param function Called as `function(const Fingerprint &, unsigned int)` from all the threads at once.
+   * @throw The first exception thrown by a thread, after all threads have finished.
+   * @attention The map must not be used meanwhile.
+   */
+  template<class Function>
+  void parallelScan(unsigned int thread_count, Function function);
+  /**
+   * @brief Get the key of a fingerprint, e.g. of a pair given by `Iterator` or `parallelScan`.
+   */
+  static Key key(const Fingerprint &fingerprint) requires std::integral<Key> {
+    return Hash::key<Key>(fingerprint.hash);
+  }
 };
 template<class Key>
+Map<Key>::Iterator::Iterator(Map &map, std::shared_ptr<const std::vector<unsigned int>> pages)
+    : map_(&map), pages_(std::move(pages)), page_index_(0) {
+  load();
+}
+template<class Key>
+void Map<Key>::Iterator::load() {
+  for (; page_index_ < pages_->size(); ++page_index_) {
+    map_->data_.getPage((*pages_)[page_index_], page_);
+    count_ = page_[0] & ((1 << 16) - 1);
+    pair_ = 0;
+    if (count_) return;
+  }
+  page_index_ = kEnd;
+  pair_ = 0;
+}
+template<class Key>
+typename Map<Key>::Iterator::value_type Map<Key>::Iterator::operator*() const {
+  return {fingerprintAt(page_, pair_), static_cast<unsigned int>(page_[kHeaderSize + pair_ * 4 + 3])};
+}
+template<class Key>
+typename Map<Key>::Iterator &Map<Key>::Iterator::operator++() {
+  if (++pair_ == count_) {
+    ++page_index_;
+    load();
+  }
+  return *this;
+}
+template<class Key>
+typename Map<Key>::Iterator Map<Key>::Iterator::operator++(int) {
+  Iterator old = *this;
+  ++*this;
+  return old;
+}
+template<class Key>
+typename Map<Key>::Iterator Map<Key>::begin() {
+  return Iterator(*this, std::make_shared<const std::vector<unsigned int>>(pageIds()));
+}
+template<class Key>
+template<class Function>
+void Map<Key>::parallelScan(unsigned int thread_count, Function function) {
+  std::vector<unsigned int> pages = pageIds();
+  data_.flush(); // the threads read the file
+  thread_count = std::max(thread_count, 1u);
+  std::vector<std::thread> threads;
+  std::vector<std::exception_ptr> errors(thread_count);
+  for (unsigned int t = 0; t < thread_count; ++t) {
+    threads.emplace_back([this, &pages, &errors, &function, t, thread_count] {
+      try {
+        Page page;
+        for (size_t i = pages.size() * t / thread_count; i < pages.size() * (t + 1) / thread_count; ++i) {
+          data_.readPage(pages[i], page);
+          unsigned int count = page[0] & ((1 << 16) - 1);
+          for (unsigned int j = 0; j < count; ++j) {
+            function(fingerprintAt(page, j), static_cast<unsigned int>(page[kHeaderSize + j * 4 + 3]));
+          }
+        }
+      } catch (...) {
+        errors[t] = std::current_exception();
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  for (auto &error : errors) {
+    if (error) std::rethrow_exception(error);
+  }
+}
+template<class Key>
+double Map<Key>::falsePositiveRate() const {
+  unsigned long long absent = filtered_ + false_positives_;
+  return absent ? static_cast<double>(false_positives_) / static_cast<double>(absent) : 0;
+}
+template<class Key>
 unsigned int Map<Key>::globalDepth() const {
   return global_depth_;
 }
@@ -165,53 +512,222 @@ unsigned int Map<Key>::size() const {
 }
 template<class Key>
 unsigned int Map<Key>::at(const Key &key) {
-  Hash_t hash = Hash()(key);
-  Bucket &bucket = getBucket(hash);
-  auto it = bucket.find(hash);
-  if (it == bucket.end()) {
-    return 0;
-  } else {
-    return it->second;
-  }
+  Fingerprint fingerprint = Hash().fingerprint(key);
+  if (filtered(fingerprint)) return 0;
+  unsigned int value = probe(fingerprint);
+  if (!value) false_positives_ += use_filter_; // stored zeros are counted too, see the attention of Map
+  return value;
 }
 template<class Key>
 void Map<Key>::erase(const Key &key) {
-  Hash_t hash = Hash()(key);
-  eraseByHash(hash);
+  eraseByHash(Hash().fingerprint(key));
+}
+template<class Key>
+template<class Range>
+void Map<Key>::bulkLoad(const Range &pairs) {
+  if (size_) {
+    for (const auto &[key, value] : pairs) insert(key, value);
+    return;
+  }
+  std::vector<std::pair<Fingerprint, unsigned int>> items;
+  for (const auto &[key, value] : pairs) items.emplace_back(Hash().fingerprint(key), value);
+  if (items.empty()) return;
+  std::stable_sort(items.begin(), items.end(), [](const auto &lhs, const auto &rhs) { return lhs.first < rhs.first; });
+  items.erase(std::unique(items.begin(), items.end(), [](const auto &lhs, const auto &rhs) {
+    return lhs.first == rhs.first;
+  }), items.end());
+  for (unsigned int id : bucketIds()) { // the buckets of the empty map are replaced
+    if (cached_.contains(id)) dropBucket(*cached_.at(id));
+    else data_.deletePage(id);
+  }
+  std::vector<std::tuple<unsigned int, Hash_t, unsigned int>> buckets;
+  buildBuckets(items.data(), items.data() + items.size(), 0, 0, buckets);
+  unsigned int depth = 0;
+  for (auto &[local_depth, prefix, id] : buckets) depth = std::max(depth, local_depth);
+  dict_.resize(1u << depth); // every entry is set below, so there is nothing to migrate
+  global_depth_ = static_cast<int>(depth);
+  migration_ = 0;
+  for (auto &[local_depth, prefix, id] : buckets) {
+    for (Hash_t i = prefix; i < (Hash_t(1) << depth); i += Hash_t(1) << local_depth) dict_.set(i, id);
+  }
+  size_ = static_cast<int>(items.size());
+  if (use_filter_) {
+    filter_capacity_ = static_cast<int>(std::max(kMinFilterCapacity, std::bit_ceil(static_cast<unsigned int>(size_))));
+    filter_.reset(filter_capacity_);
+    for (auto &[fingerprint, value] : items) filter_.add(fingerprint);
+  }
+}
+template<class Key>
+void Map<Key>::buildBuckets(std::pair<Fingerprint, unsigned int> *begin, std::pair<Fingerprint, unsigned int> *end,
+                            unsigned int depth, Hash_t prefix,
+                            std::vector<std::tuple<unsigned int, Hash_t, unsigned int>> &buckets) {
+  auto size = static_cast<unsigned int>(end - begin);
+  if (size > kPairsPerPage && depth < kMaxGlobalDepth) {
+    auto middle = std::stable_partition(begin, end, [depth](const auto &pair) { return !((pair.first.hash >> depth) & 1); });
+    buildBuckets(begin, middle, depth + 1, prefix, buckets);
+    buildBuckets(middle, end, depth + 1, prefix | (Hash_t(1) << depth), buckets);
+    return;
+  }
+  unsigned int page_count = std::max(1u, (size + kPairsPerPage - 1) / kPairsPerPage); // more than 1 only at kMaxGlobalDepth
+  std::vector<unsigned int> ids(page_count);
+  for (auto &id : ids) id = data_.newPage();
+  for (unsigned int i = 0; i < page_count; ++i) {
+    Bucket bucket(*this);
+    bucket.id = ids[i];
+    bucket.local_depth = depth;
+    bucket.next = i + 1 < page_count ? ids[i + 1] : 0;
+    unsigned int first = i * kPairsPerPage;
+    bucket.fill(begin + first, std::min(size - first, kPairsPerPage));
+  } // each page is written when the bucket is destroyed
+  buckets.emplace_back(depth, prefix, ids[0]);
 }
 template<class Key>
-void Map<Key>::eraseByHash(const Hash_t &key) {
-  Bucket &bucket = getBucket(key);
-  if (bucket.erase(key)) {
-    size_--;
+void Map<Key>::eraseByHash(const Fingerprint &key) {
+  if (filtered(key)) return;
+  Bucket *prev;
+  Bucket *bucket = findBucket(key, &prev);
+  if (!bucket) {
+    false_positives_ += use_filter_;
+    return;
   }
-  if (bucket.empty() && bucket.local_depth > 0) {
-    deleteBucket(key);
+  bucket->erase(key);
+  size_--;
+  if (use_filter_) filter_.remove(key);
+  if (prev) {
+    if (bucket->empty()) { // an empty overflow page is unlinked from the chain
+      prev->next = bucket->next;
+      dropBucket(*bucket);
+      mergeBucket(key.hash); // the bucket may have no overflow pages now
+    }
+  } else if (!bucket->next && bucket->size() <= kMergeThreshold) {
+    mergeBucket(key.hash);
   }
 }
 template<class Key>
 unsigned int &Map<Key>::operator[](const Key &key) {
-  Hash_t hash = Hash()(key);
-  insertByHash(hash, 0);
-  return getBucket(hash)[hash];
+  Fingerprint fingerprint = Hash().fingerprint(key);
+  insertByHash(fingerprint, 0);
+  return (*findBucket(fingerprint))[fingerprint];
 }
 template<class Key>
 void Map<Key>::insert(const Key &key, unsigned int value) {
-  Hash_t hash = Hash()(key);
-  insertByHash(hash, value);
+  insertByHash(Hash().fingerprint(key), value);
 }
 template<class Key>
-void Map<Key>::insertByHash(const Hash_t &key, unsigned int value) {
-  Bucket &bucket = getBucket(key);
-  if (bucket.full() && !bucket.contains(key)) {
-    if (bucket.local_depth == global_depth_) {
+void Map<Key>::insertByHash(const Fingerprint &key, unsigned int value) {
+  if (migration_) migrate(kMigrationStep);
+  Bucket *bucket = &getBucket(key.hash);
+  if (!bucket->next) { // no overflow pages, which is the common case
+    if (!bucket->full() || bucket->contains(key)) {
+      if (bucket->insert(key, value)) added(key);
+      return;
+    }
+  } else if (findBucket(key)) {
+    return;
+  } else {
+    bucket = &getBucket(key.hash);
+  }
+  if (bucket->full() && bucket->local_depth < kMaxGlobalDepth) {
+    if (bucket->local_depth == global_depth_) {
       expand();
     }
-    splitBucket(key);
+    splitBucket(key.hash);
     insertByHash(key, value);
+    return;
+  }
+  while (bucket->full()) { // the bucket cannot be split, find a page with room in the chain
+    if (!bucket->next) {
+      bucket->next = data_.newPage();
+      Bucket &overflow = fetchBucket(bucket->next); // bucket is the most recently used page, so it is not evicted
+      overflow.local_depth = bucket->local_depth;
+      bucket = &overflow;
+    } else {
+      bucket = &fetchBucket(bucket->next);
+    }
+  }
+  bucket->insert(key, value);
+  added(key);
+}
+template<class Key>
+void Map<Key>::added(const Fingerprint &key) {
+  size_++;
+  if (!use_filter_) return;
+  if (size_ > filter_capacity_) {
+    rebuildFilter(filter_capacity_ * 2);
   } else {
-    size_ += bucket.insert(key, value);
+    filter_.add(key);
+  }
+}
+template<class Key>
+bool Map<Key>::filtered(const Fingerprint &key) {
+  if (!use_filter_ || filter_.mayContain(key)) return false;
+  ++filtered_;
+  return true;
+}
+template<class Key>
+std::vector<unsigned int> Map<Key>::bucketIds() {
+  std::vector<unsigned int> ids;
+  for (unsigned int i = 0; i < (1u << global_depth_); ++i) ids.push_back(getBucketId(i));
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+  return ids;
+}
+template<class Key>
+std::vector<unsigned int> Map<Key>::pageIds() {
+  flush();
+  std::vector<unsigned int> ids;
+  for (unsigned int id : bucketIds()) {
+    for (unsigned int page = id; page;) {
+      ids.push_back(page);
+      int header[2];
+      data_.getPart(page, 0, 2, header);
+      page = header[1];
+    }
+  }
+  std::sort(ids.begin(), ids.end());
+  return ids;
+}
+template<class Key>
+void Map<Key>::rebuildFilter(unsigned int capacity) {
+  filter_.reset(capacity);
+  for (unsigned int id : bucketIds()) {
+    for (unsigned int page = id; page;) {
+      Bucket &bucket = fetchBucket(page);
+      for (unsigned int i = 0; i < bucket.size(); ++i) filter_.add(bucket.fingerprintAt(i));
+      page = bucket.next;
+    }
+  }
+  filter_capacity_ = static_cast<int>(capacity);
+}
+template<class Key>
+Map<Key>::Bucket *Map<Key>::findBucket(const Fingerprint &key, Bucket **prev) {
+  Bucket *bucket = &getBucket(key.hash), *last = nullptr;
+  while (!bucket->contains(key)) {
+    if (!bucket->next) return nullptr;
+    last = bucket;
+    bucket = &fetchBucket(bucket->next); // last is the most recently used page, so it is not evicted
+  }
+  if (prev) *prev = last;
+  return bucket;
+}
+template<class Key>
+unsigned int Map<Key>::probe(const Fingerprint &key) {
+  for (unsigned int id = getBucketId(key.hash); id;) {
+    auto it = cached_.find(id);
+    if (it != cached_.end()) { // the cached bucket may differ from the page
+      const Bucket &bucket = *it->second;
+      if (const unsigned int *value = bucket.find(key)) return *value;
+      id = bucket.next;
+      continue;
+    }
+    const int *page = data_.pinPage(id);
+    const unsigned int *value = findInPage(page, page[0] & ((1 << 16) - 1), key);
+    unsigned int result = value ? *value : 0, next = page[1];
+    data_.unpinPage(id, false);
+    if (value) return result;
+    id = next;
   }
+  return 0;
 }
 template<class Key>
 Map<Key>::~Map() {
@@ -219,30 +735,61 @@ Map<Key>::~Map() {
 }
 template<class Key>
 void Map<Key>::expand() {
-  if (global_depth_ == kMaxGlobalDepth) {
+  if (global_depth_ == kMaxGlobalDepth) { // not reachable, see insertByHash
     throw std::runtime_error("The global depth has reached the maximum!");
   }
-  dict_.double_size();
+  migration_ += static_cast<int>(dict_.size());
+  dict_.resize(dict_.size() << 1);
   global_depth_++;
 }
 template<class Key>
-void Map<Key>::deleteBucket(const Hash_t &key) {
-  Bucket old(std::move(getBucket(key)));
-  unsigned int bucket_id = old.id;
-  unsigned int local_depth = old.local_depth;
-  unsigned int sibling_id = getBucketId(key ^ (1 << (local_depth - 1)));
-  for (unsigned int i = (key & ((1 << local_depth) - 1)); i < (1 << global_depth_); i += (1 << local_depth)) {
-    dict_.set(i, sibling_id);
+void Map<Key>::migrate(unsigned int count) {
+  for (; count && migration_; --count) {
+    unsigned int i = dict_.size() - migration_--;
+    if (!dict_.get(i)) dict_.set(i, dict_.get(i ^ std::bit_floor(i))); // the lower entry is migrated already
   }
+}
+template<class Key>
+void Map<Key>::mergeBucket(const Hash_t &key) {
+  for (;;) {
+    Bucket &bucket = getBucket(key);
+    unsigned int local_depth = bucket.local_depth;
+    if (local_depth == 0 || bucket.next) return;
+    unsigned int buddy_id = getBucketId(key ^ (Hash_t(1) << (local_depth - 1)));
+    Bucket &buddy = fetchBucket(buddy_id); // bucket is the most recently used bucket, so it is not evicted
+    if (buddy.local_depth != local_depth || buddy.next || bucket.size() + buddy.size() > kMergeThreshold) return;
+    buddy.absorb(bucket);
+    buddy.local_depth--;
+    for (unsigned int i = (key & ((1 << local_depth) - 1)); i < (1u << global_depth_); i += (1 << local_depth)) {
+      dict_.set(i, buddy_id);
+    }
+    dropBucket(bucket);
+    if (local_depth == static_cast<unsigned int>(global_depth_)) shrink();
+  }
+}
+template<class Key>
+void Map<Key>::shrink() {
+  while (global_depth_ > 0) {
+    unsigned int half = 1u << (global_depth_ - 1);
+    for (unsigned int i = 0; i < half; ++i) {
+      if (getBucketId(i) != getBucketId(i + half)) return; // a bucket has the global depth
+    }
+    dict_.halve_size();
+    global_depth_--;
+    migration_ = std::max(migration_ - static_cast<int>(half), 0); // the upper half is dropped
+  }
+}
+template<class Key>
+void Map<Key>::dropBucket(Bucket &bucket) {
+  unsigned int bucket_id = bucket.id;
+  bucket.id = 0; // the page is deleted, so the bucket must not be written back
+  cache_.erase(cached_.at(bucket_id));
+  cached_.erase(bucket_id);
   data_.deletePage(bucket_id);
-  old.id = 0;
-  Bucket &sibling = getBucket(sibling_id);
-  sibling.local_depth--;
 }
 template<class Key>
 unsigned int Map<Key>::splitBucket(const Hash_t &key) {
-  Bucket old(std::move(getBucket(key)));
-  bool flag = old.getLocalHighBit(key);
+  Bucket &old = getBucket(key);
   unsigned int new_id = data_.newPage();
   Bucket new_bucket = old.split();
   new_bucket.id = new_id;
@@ -253,22 +800,52 @@ unsigned int Map<Key>::splitBucket(const Hash_t &key) {
        i < (1 << global_depth_); i += (1 << new_local_depth)) {
     dict_.set(i, new_id);
   }
-  cache_ = std::move(flag ? new_bucket : old);
+  if (cache_.size() >= bucket_count_) { // old is the most recently used bucket, so it is not evicted
+    cached_.erase(cache_.back().id);
+    cache_.pop_back();
+  }
+  cache_.push_front(std::move(new_bucket));
+  cached_[new_id] = cache_.begin();
   return new_id;
 }
 template<class Key>
 Map<Key>::Bucket &Map<Key>::getBucket(const Hash_t &key) {
-  unsigned int bucket_id = getBucketId(key);
-  if (bucket_id == cache_.id) {
-    return cache_;
-  } else {
-    cache_ = {*this, bucket_id};
-    return cache_;
+  return fetchBucket(getBucketId(key));
+}
+template<class Key>
+Map<Key>::Bucket &Map<Key>::fetchBucket(unsigned int bucket_id) {
+  auto it = cached_.find(bucket_id);
+  if (it != cached_.end()) {
+    cache_.splice(cache_.begin(), cache_, it->second);
+    return cache_.front();
   }
+  if (cache_.size() < bucket_count_) {
+    cache_.emplace_front(*this, bucket_id);
+  } else { // reuse the least recently used entry, which is written back by the assignment
+    cached_.erase(cache_.back().id);
+    cache_.splice(cache_.begin(), cache_, std::prev(cache_.end()));
+    cache_.front() = Bucket(*this, bucket_id);
+  }
+  cached_[bucket_id] = cache_.begin();
+  return cache_.front();
 }
 template<class Key>
 void Map<Key>::flush() {
-  cache_ = {*this};
+  for (Bucket &bucket : cache_) bucket.flush();
+}
+template<class Key>
+void Map<Key>::checkpoint() {
+  flush();
+  data_.flush();
+  data_.flushInfo();
+  dict_.checkpoint();
+  if (use_filter_) filter_.checkpoint();
+}
+template<class Key>
+void Map<Key>::sync() {
+  data_.sync();
+  dict_.sync();
+  if (use_filter_) filter_.sync();
 }
 template<class Key>
 void Map<Key>::initialize(bool reset) {
@@ -276,23 +853,44 @@ void Map<Key>::initialize(bool reset) {
   dict_.initialize(reset);
   dict_.cache();
   if (reset) {
+    layout_ = kLayoutVersion;
+    hash_version_ = Hash::kVersion;
     unsigned int id = data_.newPage();
-    Bucket bucket(*this, id);
     dict_.push_back(id);
+  } else if (layout_ != kLayoutVersion) {
+    throw std::runtime_error(file_name_ + " has the layout version " + std::to_string(layout_) + " instead of "
+                                 + std::to_string(kLayoutVersion) + ", the database has to be rebuilt");
+  } else if (hash_version_ != Hash::kVersion) { // the keys are not stored, so they cannot be rehashed
+    throw std::runtime_error(file_name_ + " has the hash version " + std::to_string(hash_version_) + " instead of "
+                                 + std::to_string(Hash::kVersion) + ", the database has to be rebuilt");
+  }
+  if (!use_filter_) {
+    filter_capacity_ = 0; // the filter is not maintained from now on
+    return;
+  }
+  filter_.initialize(reset);
+  if (!filter_capacity_ || !filter_.sizedFor(filter_capacity_)) {
+    rebuildFilter(std::max(kMinFilterCapacity, std::bit_ceil(static_cast<unsigned int>(size_))));
   }
 }
 template<class Key>
 unsigned int Map<Key>::getBucketId(const Hash_t &key) {
-  return dict_.get(key & ((1 << global_depth_) - 1));
+  unsigned int index = key & ((1u << global_depth_) - 1);
+  unsigned int id = dict_.get(index);
+  while (!id) { // not migrated yet, see expand
+    index ^= std::bit_floor(index);
+    id = dict_.get(index);
+  }
+  return id;
 }
 /**
- * @brief A multimap that maps a key to a vector of non-zero integers.
+ * @brief A multimap that maps a key to a set of non-negative integers.
  * @details The multimap is based on extendible hashing.
+ * @details The values of a key are kept sorted and without duplicates, in a compressed `PostingList`.
  * @tparam Key The type of the key.
- * @attention Storing zero as value is undefined!
- * @attention There is way to erase a key-value pair. To erase a key-value pair, update the vector of the key. For performance, it's recommended to erase lazily after calling `findAll`.
+ * @note A key-value pair is erased by `erase(key, value)`, which rewrites only the tail of the list when the value is the greatest of the key.
  * @attention The key must be hashable, and the uniformity of the hash function is important.
- * @attention No collision handling is implemented! To avoid collision, it's recommended to insert less than 1e6 keys.
+ * @note Keys are identified by their fingerprints, see `Map`.
  * @note The vector storage (i.e. Vectors) class is shared by all classes that use it. Therefore, it's passed as a reference to the constructor.
  */
 template<class Key> // the value is int
@@ -305,7 +903,8 @@ class MultiMap {
   /**
    * @brief Construct a new MultiMap object.
    */
-  MultiMap(std::string file_name, Vectors &vectors) : file_name_(std::move(file_name)), vector_pos_(file_name_ + "_dict"), vectors_(vectors) {};
+  MultiMap(std::string file_name, Vectors &vectors, unsigned int bucket_count = Map<Key>::kDefaultBucketCount)
+      : file_name_(std::move(file_name)), vector_pos_(file_name_ + "_dict", bucket_count), vectors_(vectors) {};
   /**
    * @brief Destroy the MultiMap object.
    */
@@ -327,24 +926,45 @@ class MultiMap {
    */
   void erase(const Key &key);
   /**
-   * @brief Update the vector of the key.
-   * @details If the vector is empty, the key is erased.
+   * @brief Erase a key-value pair from the multimap, if it is in it.
+   * @details The key is erased when its last value is erased.
+   * @param key The key.
+   * @param value The value.
+   */
+  void erase(const Key &key, int value);
+  /**
+   * @brief Replace the values of the key.
+   * @details If the values are empty, the key is erased.
    * @param key The key.
-   * @param values The vector.
+   * @param values The values, sorted and deduplicated here.
    */
   void update(const Key &key, std::vector<int> &&values = {});
   /**
    * @brief Find all values of the key.
-   * @details The result may contain duplicated values as well as deleted values (as there is no way to erase a key-value pair). It's the user's responsibility to remove them. It's recommended to call `update` to remove them in this multimap.
    * @param key The key.
-   * @return The result.
+   * @return The values, in ascending order and without duplicates.
    */
   std::vector<int> findAll(const Key &key);
+  /**
+   * @brief Write all cached data of the map from keys to vectors back to the files.
+   * @attention The vectors are shared, they should be checkpointed by their owner.
+   */
+  void checkpoint();
+  /**
+   * @brief Write the files of the map from keys to vectors to the disk, after `checkpoint`.
+   * @attention The vectors are shared, they should be synchronized by their owner.
+   */
+  void sync() { vector_pos_.sync(); }
 };
 template<class Key>
+void MultiMap<Key>::checkpoint() {
+  vector_pos_.checkpoint();
+}
+template<class Key>
 std::vector<int> MultiMap<Key>::findAll(const Key &key) {
   unsigned int pos = vector_pos_.at(key);
-  return vectors_.getVector(pos).getData();
+  auto vector = vectors_.getVector(pos);
+  return PostingList::read(vector);
 }
 template<class Key>
 void MultiMap<Key>::erase(const Key &key) {
@@ -355,10 +975,25 @@ void MultiMap<Key>::erase(const Key &key) {
   }
 }
 template<class Key>
+void MultiMap<Key>::erase(const Key &key, int value) {
+  unsigned int pos = vector_pos_.at(key);
+  if (!pos) {
+    return;
+  }
+  auto vector = vectors_.getVector(pos);
+  if (PostingList::erase(vector, value)) {
+    pos = vector.getPos();
+    if (pos) vector_pos_[key] = pos;
+    else vector_pos_.erase(key);
+  }
+}
+template<class Key>
 void MultiMap<Key>::update(const Key &key, std::vector<int> &&values) {
   unsigned int pos = vector_pos_.at(key);
   auto vector = vectors_.getVector(pos);
-  if (vector.update(std::move(values))) {
+  std::sort(values.begin(), values.end());
+  values.erase(std::unique(values.begin(), values.end()), values.end());
+  if (PostingList::write(vector, values)) {
     pos = vector.getPos();
     if (pos) vector_pos_[key] = pos;
     else vector_pos_.erase(key);
@@ -368,7 +1003,7 @@ template<class Key>
 void MultiMap<Key>::insert(const Key &key, int value) {
   unsigned int pos = vector_pos_.at(key);
   auto vector = vectors_.getVector(pos);
-  if (vector.push_back(value)) {
+  if (PostingList::insert(vector, value)) {
     pos = vector.getPos();
     vector_pos_[key] = pos;
   }
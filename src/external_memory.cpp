@@ -6,93 +6,156 @@
 
 namespace external_memory {
 void Array::initialize(bool reset) {
-  if (reset) {
-    file_.open(file_name_, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
-  } else {
-    file_.open(file_name_, std::ios::in | std::ios::out | std::ios::binary);
-  }
-  if (!file_.is_open()) {
-    throw std::runtime_error("Cannot open file " + file_name_);
-  }
-  file_.seekg(0, std::ios::end);
-  size_ = file_.tellg() / sizeof(int);
+  file_.open(reset);
+  size_ = file_.size() / sizeof(int);
 }
 unsigned int Array::size() const {
   return size_;
 }
 int Array::get(unsigned int n) {
   if (cached_) {
-    return cache_[n];
+    const int *data = loaded_[n / kIntegerPerPage] ? cache_[n / kIntegerPerPage].get() : load(n / kIntegerPerPage);
+    return data ? data[n % kIntegerPerPage] : 0;
+  } else if (file_.mapped()) {
+    return mapped()[n];
   } else {
-    file_.seekg(n * sizeof(int), std::ios::beg);
     int value = 0;
-    file_.read(reinterpret_cast<char *>(&value), sizeof(int));
+    file_.read(n * sizeof(int), &value, sizeof(int));
     return value;
   }
 }
+void Array::markDirty(unsigned int begin, unsigned int end) {
+  if (begin >= end) return;
+  dirty_.resize(cache_.size());
+  for (unsigned int i = begin / kIntegerPerPage; i <= (end - 1) / kIntegerPerPage; ++i) {
+    dirty_[i] = true;
+  }
+}
+int *Array::block(unsigned int n) {
+  if (!loaded_[n / kIntegerPerPage]) load(n / kIntegerPerPage);
+  std::unique_ptr<int[]> &data = cache_[n / kIntegerPerPage];
+  if (!data) data = std::make_unique<int[]>(kIntegerPerPage);
+  return data.get();
+}
+const int *Array::load(unsigned int i) {
+  cache_[i] = std::make_unique<int[]>(kIntegerPerPage);
+  file_.read(static_cast<size_t>(i) * kPageSize, cache_[i].get(), kPageSize);
+  size_t end = static_cast<size_t>(i + 1) * kIntegerPerPage;
+  if (end > size_) { // the file may be longer than the list, after halve_size
+    memset(cache_[i].get() + kIntegerPerPage - (end - size_), 0, (end - size_) * sizeof(int));
+  }
+  loaded_[i] = true;
+  return cache_[i].get();
+}
 void Array::set(unsigned int n, int value) {
   if (cached_) {
-    cache_[n] = value;
+    block(n)[n % kIntegerPerPage] = value;
+    markDirty(n, n + 1);
+  } else if (file_.mapped()) {
+    mapped()[n] = value;
   } else {
-    file_.seekp(n * sizeof(int), std::ios::beg);
-    file_.write(reinterpret_cast<char *>(&value), sizeof(int));
+    file_.write(n * sizeof(int), &value, sizeof(int));
   }
 }
 unsigned int Array::push_back(int value) {
   if (cached_) {
-    cache_.push_back(value);
-    size_ = cache_.size();
-    return cache_.size() - 1;
+    if (size_ % kIntegerPerPage == 0) {
+      cache_.emplace_back();
+      loaded_.push_back(true);
+    }
+    set(size_, value);
+    return size_++;
   } else {
-    file_.seekp(0, std::ios::end);
-    file_.write(reinterpret_cast<char *>(&value), sizeof(int));
+    file_.write(size_ * sizeof(int), &value, sizeof(int));
     return size_++;
   }
 }
-void Array::cache() {
-  if (!cached_) {
-    cache_.resize(size_);
-    file_.seekg(0, std::ios::beg);
-    for (unsigned int i = 0; i < size_; ++i) {
-      file_.read(reinterpret_cast<char *>(&cache_[i]), sizeof(int));
-    }
+void Array::cache(bool lazy) {
+  if (!cached_ && !file_.mapped()) {
+    unsigned int blocks = (size_ + kIntegerPerPage - 1) / kIntegerPerPage;
+    cache_.resize(blocks);
+    dirty_.assign(blocks, false);
+    loaded_.assign(blocks, !lazy);
     cached_ = true;
+    if (lazy) return;
+    iovec iov[kMaxBatch];
+    for (unsigned int begin = 0; begin < blocks; begin += kMaxBatch) {
+      int count = static_cast<int>(std::min<unsigned int>(kMaxBatch, blocks - begin));
+      for (int i = 0; i < count; ++i) {
+        cache_[begin + i] = std::make_unique<int[]>(kIntegerPerPage);
+        iov[i] = {cache_[begin + i].get(), kPageSize};
+      }
+      file_.readv(static_cast<size_t>(begin) * kPageSize, iov, count);
+    }
+    if (size_ % kIntegerPerPage) { // the file may be longer than the list, after halve_size
+      memset(cache_.back().get() + size_ % kIntegerPerPage, 0, (kIntegerPerPage - size_ % kIntegerPerPage) * sizeof(int));
+    }
   }
 }
+void Array::checkpoint() {
+  if (!cached_) return;
+  unsigned int blocks = dirty_.size();
+  iovec iov[kMaxBatch];
+  for (unsigned int begin = 0; begin < blocks;) {
+    if (!dirty_[begin]) {
+      ++begin;
+      continue;
+    }
+    int count = 0;
+    unsigned int end = begin;
+    for (; end < blocks && dirty_[end] && count < kMaxBatch; ++end, ++count) { // a dirty block is allocated
+      dirty_[end] = false;
+      size_t first = static_cast<size_t>(end) * kIntegerPerPage;
+      size_t last = std::min<size_t>(first + kIntegerPerPage, size_);
+      iov[count] = {cache_[end].get(), (last - first) * sizeof(int)};
+    }
+    file_.writev(static_cast<size_t>(begin) * kPageSize, iov, count);
+    begin = end;
+  }
+  if (file_.size() != size_ * sizeof(int)) file_.resize(size_ * sizeof(int)); // after resize or halve_size
+  file_.flush();
+}
 void Array::flush() {
   if (cached_) {
-    file_.close();
-    file_.open(file_name_, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
-    for (unsigned int i = 0; i < size_; ++i) {
-      file_.write(reinterpret_cast<char *>(&cache_[i]), sizeof(int));
-    }
+    checkpoint();
+    cache_.clear();
+    dirty_.clear();
+    loaded_.clear();
     cached_ = false;
   }
 }
 void Array::double_size() {
   if (cached_) {
-    cache_.resize(size_ << 1);
-    memcpy(cache_.data() + size_, cache_.data(), size_ * sizeof(int));
-  } else {
+    cache_.resize((size_ * 2 + kIntegerPerPage - 1) / kIntegerPerPage);
+    loaded_.resize(cache_.size(), true); // the new blocks are not in the file
     for (unsigned int i = 0; i < size_; ++i) {
-      int value = 0;
-      file_.seekg(i * sizeof(int), std::ios::beg);
-      file_.read(reinterpret_cast<char *>(&value), sizeof(int));
-      file_.seekp((i + size_) * sizeof(int), std::ios::beg);
-      file_.write(reinterpret_cast<char *>(&value), sizeof(int));
+      if (int value = get(i)) set(size_ + i, value);
     }
+  } else {
+    file_.copy(0, static_cast<size_t>(size_) * sizeof(int), static_cast<size_t>(size_) * sizeof(int));
   }
   size_ <<= 1;
 }
 void Array::halve_size() {
+  resize(size_ >> 1);
+}
+void Array::resize(unsigned int size) {
   if (cached_) {
-    cache_.resize(size_ >> 1);
+    if (size < size_ && size % kIntegerPerPage && !loaded_[size / kIntegerPerPage]) load(size / kIntegerPerPage);
+    if (size < size_ && size % kIntegerPerPage && cache_[size / kIntegerPerPage]) { // the tail must read as 0 if the list grows again
+      memset(cache_[size / kIntegerPerPage].get() + size % kIntegerPerPage, 0,
+             (kIntegerPerPage - size % kIntegerPerPage) * sizeof(int));
+    }
+    cache_.resize((size + kIntegerPerPage - 1) / kIntegerPerPage); // the file is resized by checkpoint
+    loaded_.resize(cache_.size(), true); // the new blocks are not in the file
+    dirty_.resize(cache_.size());
+    unsigned int stale = std::min<size_t>(file_.size() / sizeof(int), size); // left in the file by a shrink
+    for (unsigned int n = size_; n < stale; n = (n / kIntegerPerPage + 1) * kIntegerPerPage) block(n);
+    markDirty(size_, stale);
   } else {
-    file_.close();
-    std::filesystem::resize_file(file_name_, (size_ >> 1) * sizeof(int));
-    file_.open(file_name_, std::ios::in | std::ios::out | std::ios::binary);
+    file_.resize(static_cast<size_t>(size) * sizeof(int));
   }
-  size_ >>= 1;
+  size_ = size;
 }
 Array::~Array() {
   if (cached_) {
@@ -101,25 +164,168 @@ Array::~Array() {
   file_.close();
 }
 
+BufferPool::BufferPool(File &file, unsigned int frame_count, size_t base)
+    : file_(file), base_(base), frames_(frame_count) {
+  for (unsigned int i = 0; i < frame_count; ++i) {
+    frames_[i].lru_pos = clean_lru_.insert(clean_lru_.end(), i);
+  }
+}
+unsigned int BufferPool::load(unsigned int n) {
+  unsigned int count = 1;
+  if (n == last_miss_ + 1) { // sequential access, read ahead
+    count = std::max(1u, std::min<unsigned int>(kReadAhead, frames_.size() / 4));
+  }
+  iovec iov[kReadAhead];
+  unsigned int indices[kReadAhead];
+  unsigned int loaded = 0;
+  for (unsigned int page = n; loaded < count; ++page, ++loaded) {
+    if (page != n && (page_table_.contains(page) || position(page) >= file_.size())) break;
+    if (page != n && clean_lru_.empty()) break; // reading ahead never writes dirty pages back
+    unsigned int index = victim(); // not in the lists, so it is not chosen again
+    Frame &frame = frames_[index];
+    frame.page = page;
+    page_table_.emplace(page, index);
+    iov[loaded] = {frame.data, kPageSize};
+    indices[loaded] = index;
+  }
+  file_.readv(position(n), iov, static_cast<int>(loaded));
+  for (unsigned int i = loaded - 1; i > 0; --i) { // the pages read ahead are unpinned, the n-th page is pinned by the caller
+    Frame &frame = frames_[indices[i]];
+    frame.lru_pos = clean_lru_.insert(clean_lru_.begin(), indices[i]);
+  }
+  last_miss_ = n + loaded - 1;
+  return indices[0];
+}
+void BufferPool::writeFrame(BufferPool::Frame &frame) {
+  size_t pos = position(frame.page);
+  if (pos < limit_) {
+    if (before_write_back_) before_write_back_();
+    file_.write(pos, frame.data, std::min<size_t>(kPageSize, limit_ - pos));
+  }
+  frame.dirty = false;
+}
+void BufferPool::modify(BufferPool::Frame &frame) {
+  frame.dirty = true;
+  frame.held |= hold_;
+}
+unsigned int BufferPool::victim() {
+  std::list<unsigned int> &list = clean_lru_.empty() ? dirty_lru_ : clean_lru_;
+  if (list.empty()) {
+    if (held_.empty()) throw std::runtime_error("All frames of the buffer pool are pinned");
+    frames_.emplace_back(); // held pages stay until they are released
+    return frames_.size() - 1;
+  }
+  unsigned int index = list.back();
+  Frame &frame = frames_[index];
+  if (frame.page) {
+    if (frame.dirty) writeFrame(frame);
+    page_table_.erase(frame.page);
+    frame.page = 0;
+  }
+  list.pop_back();
+  return index;
+}
+int *BufferPool::pin(unsigned int n, bool reset) {
+  if (file_.mapped()) {
+    file_.reserve(position(n + 1));
+    int *page = reinterpret_cast<int *>(file_.data() + position(n));
+    if (reset) memset(page, 0, kPageSize);
+    return page;
+  }
+  unsigned int index;
+  auto it = page_table_.find(n);
+  if (it != page_table_.end()) {
+    index = it->second;
+    Frame &frame = frames_[index];
+    if (!frame.pin_count) lru(frame).erase(frame.lru_pos);
+    if (reset) {
+      memset(frame.data, 0, kPageSize);
+      modify(frame);
+    }
+  } else {
+    if (reset) {
+      index = victim();
+      Frame &frame = frames_[index];
+      frame.page = n;
+      memset(frame.data, 0, kPageSize);
+      modify(frame);
+      page_table_.emplace(n, index);
+    } else {
+      index = load(n);
+    }
+  }
+  Frame &frame = frames_[index];
+  ++frame.pin_count;
+  return frame.data;
+}
+void BufferPool::unpin(unsigned int n, bool dirty) {
+  if (file_.mapped()) return;
+  unsigned int index = page_table_.at(n);
+  Frame &frame = frames_[index];
+  if (dirty) modify(frame);
+  if (--frame.pin_count == 0) {
+    std::list<unsigned int> &list = lru(frame);
+    frame.lru_pos = list.insert(list.begin(), index);
+  }
+}
+void BufferPool::flush() {
+  std::vector<Frame *> dirty;
+  for (auto &frame : frames_) {
+    if (frame.page && frame.dirty && position(frame.page) < limit_) dirty.push_back(&frame);
+    frame.dirty = false;
+    frame.held = false;
+  }
+  clean_lru_.splice(clean_lru_.begin(), dirty_lru_); // the positions stay valid
+  clean_lru_.splice(clean_lru_.begin(), held_);
+  if (dirty.empty()) return;
+  if (before_write_back_) before_write_back_();
+  std::sort(dirty.begin(), dirty.end(), [](const Frame *lhs, const Frame *rhs) { return lhs->page < rhs->page; });
+  iovec iov[kMaxBatch];
+  for (size_t begin = 0, end; begin < dirty.size(); begin = end) { // each run of consecutive pages is written at once
+    int count = 0;
+    for (end = begin; end < dirty.size() && count < kMaxBatch
+        && dirty[end]->page == dirty[begin]->page + count; ++end, ++count) {
+      size_t pos = position(dirty[end]->page);
+      iov[count] = {dirty[end]->data, std::min<size_t>(kPageSize, limit_ - pos)};
+    }
+    file_.writev(position(dirty[begin]->page), iov, count);
+  }
+}
+void BufferPool::release() {
+  for (unsigned int index : held_) frames_[index].held = false;
+  dirty_lru_.splice(dirty_lru_.begin(), held_);
+}
+void BufferPool::clear() {
+  clean_lru_.clear();
+  dirty_lru_.clear();
+  held_.clear();
+  for (unsigned int i = 0; i < frames_.size(); ++i) {
+    Frame &frame = frames_[i];
+    frame.page = 0;
+    frame.pin_count = 0;
+    frame.dirty = false;
+    frame.held = false;
+    frame.lru_pos = clean_lru_.insert(clean_lru_.end(), i);
+  }
+  page_table_.clear();
+}
+bool BufferPool::contains(unsigned int n) const {
+  return file_.mapped() || page_table_.contains(n);
+}
+
 void Pages::initialize(bool reset) {
+  file_.open(reset);
   if (reset) {
-    file_.open(file_name_, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
     memset(info_, 0, sizeof(Page));
-    file_.write(reinterpret_cast<char *>(info_), sizeof(Page));
+    file_.write(0, info_, sizeof(Page));
     size_ = 0;
     free_head_ = 0;
   } else {
-    file_.open(file_name_, std::ios::in | std::ios::out | std::ios::binary);
-    file_.seekg(0, std::ios::end);
-    size_ = file_.tellg() / kPageSize - 1;
-    file_.seekg(0, std::ios::beg);
-    file_.read(reinterpret_cast<char *>(info_), sizeof(Page));
+    size_ = file_.size() / kPageSize - 1;
+    file_.read(0, info_, sizeof(Page));
     free_head_ = info_[0];
   }
-  cache_index_ = 0;
-  if (!file_.is_open()) {
-    throw std::runtime_error("Cannot open file " + file_name_);
-  }
+  pool_.clear();
 }
 unsigned int Pages::size() const {
   return size_;
@@ -128,59 +334,37 @@ void Pages::getInfo(unsigned int n, int &dest) {
   dest = info_[n];
 }
 void Pages::fetchPage(unsigned int n, bool reset) {
-  if (n == cache_index_) {
-    if (reset) {
-      memset(cache_, 0, kPageSize);
-    }
-    return;
-  }
-  flush();
-  if (reset) {
-    memset(cache_, 0, kPageSize);
-  } else {
-    file_.seekg(n * kPageSize, std::ios::beg);
-    file_.read(reinterpret_cast<char *>(cache_), kPageSize);
-  }
-  cache_index_ = n;
+  pool_.pin(n, reset);
+  pool_.unpin(n, false);
+}
+int *Pages::pinPage(unsigned int n, bool reset) {
+  return pool_.pin(n, reset);
+}
+void Pages::unpinPage(unsigned int n, bool dirty) {
+  pool_.unpin(n, dirty);
 }
 void Pages::flush() {
-  if (cache_index_) {
-    file_.seekp(cache_index_ * kPageSize, std::ios::beg);
-    file_.write(reinterpret_cast<char *>(cache_), kPageSize);
-    cache_index_ = 0;
-  }
+  pool_.flush();
+  file_.flush();
 }
 void Pages::getPage(unsigned int n, int *dest) {
-  if (n == cache_index_) {
-    memcpy(dest, cache_, kPageSize);
-  } else {
-    file_.seekg(n * kPageSize, std::ios::beg);
-    file_.read(reinterpret_cast<char *>(dest), kPageSize);
-  }
+  memcpy(dest, pool_.pin(n), kPageSize);
+  pool_.unpin(n, false);
+}
+void Pages::readPage(unsigned int n, int *dest) {
+  pool_.read(n, dest);
 }
 void Pages::setPage(unsigned int n, const int *value) {
-  if (n == cache_index_) {
-    memcpy(cache_, value, kPageSize);
-  } else {
-    file_.seekp(n * kPageSize, std::ios::beg);
-    file_.write(reinterpret_cast<const char *>(value), kPageSize);
-  }
+  memcpy(pool_.pin(n, true), value, kPageSize);
+  pool_.unpin(n, true);
 }
 void Pages::getPart(unsigned int n, unsigned int offset, unsigned int len, int *dest) {
-  if (n == cache_index_) {
-    memcpy(dest, cache_ + offset, len * sizeof(int));
-  } else {
-    file_.seekg(n * kPageSize + offset * sizeof(int), std::ios::beg);
-    file_.read(reinterpret_cast<char *>(dest), len * sizeof(int));
-  }
+  memcpy(dest, pool_.pin(n) + offset, len * sizeof(int));
+  pool_.unpin(n, false);
 }
 void Pages::setPart(unsigned int n, unsigned int offset, unsigned int len, const int *value) {
-  if (n == cache_index_) {
-    memcpy(cache_ + offset, value, len * sizeof(int));
-  } else {
-    file_.seekp(n * kPageSize + offset * sizeof(int), std::ios::beg);
-    file_.write(reinterpret_cast<const char *>(value), len * sizeof(int));
-  }
+  memcpy(pool_.pin(n) + offset, value, len * sizeof(int));
+  pool_.unpin(n, true);
 }
 unsigned int Pages::toPosition(unsigned int n, unsigned int offset) {
   return n * kIntegerPerPage + offset;
@@ -206,6 +390,12 @@ unsigned int Pages::newPage(const int *value) {
     return n;
   }
 }
+unsigned int Pages::newPages(unsigned int count) {
+  unsigned int n = size_ + 1;
+  size_ += count;
+  file_.reserve(static_cast<size_t>(size_ + 1) * kPageSize); // so that the size of the file accounts for the pages
+  return n;
+}
 void Pages::deletePage(unsigned int n) {
   setPart(n, 0, 1, &free_head_);
   free_head_ = n;
@@ -216,8 +406,8 @@ Pages::~Pages() {
   file_.close();
 }
 void Pages::flushInfo() {
-  file_.seekp(0, std::ios::beg);
-  file_.write(reinterpret_cast<char *>(info_), sizeof(Page));
+  file_.write(0, info_, sizeof(Page));
+  file_.flush();
 }
 void Pages::setInfo(unsigned int n, int value) {
   info_[n] = value;
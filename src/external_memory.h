@@ -5,11 +5,18 @@
 #ifndef BOOKSTORE_SRC_EXTERNAL_MEMORY_H_
 #define BOOKSTORE_SRC_EXTERNAL_MEMORY_H_
 
+#include <algorithm>
+#include <cstdint>
 #include <string>
 #include <vector>
-#include <fstream>
 #include <filesystem>
 #include <cstring>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include "external_file.h"
 
 namespace external_memory {
 constexpr char kFileExtension[] = ".db";
@@ -24,6 +31,135 @@ concept ListElement = requires(T t) {
     && requires(const T t) { t.toBytes(nullptr); }
     && std::is_constructible_v<T, const char *>
     && (T::byte_size() >= sizeof(unsigned int));
+/**
+ * @brief A buffer pool that keeps a fixed number of pages of a file in memory.
+ *
+ * @details
+ * Page `n` of the file occupies the bytes `[base + (n - 1) * kPageSize, base + n * kPageSize)`.
+ * Bytes at or beyond the limit (see `limit`) are never written back, so that the file does not grow beyond its logical size.
+ *
+ * A page has to be pinned before its frame is accessed, and unpinned afterwards.
+ * Pinned frames are never evicted. When a frame is needed, the least recently used clean (or empty) frame is evicted,
+ * and the least recently used dirty frame only if all unpinned frames are dirty.
+ * The unpinned frames are kept in LRU lists, one for clean frames and one for dirty frames, so the victim is found in constant time.
+ * A frame is written back to the file only if it has been marked as dirty.
+ * `flush` writes each run of consecutive dirty pages with a single vectored write.
+ *
+ * When a page is missed right after the previous page was missed, the following pages are read ahead with a single vectored read. Reading ahead only takes clean (or empty) frames.
+ *
+ * After `holdChanges`, the pages modified since the last `release` are held: they are never evicted (no-steal),
+ * so that the changes of an unfinished command never reach the file. If only held or pinned frames are left, the pool grows by a frame.
+ * A hook (see `beforeWriteBack`) runs before any page is written back, e.g. to synchronize the write-ahead log up to that point.
+ *
+ * If the file is memory mapped, the pool keeps no frames: pinning a page returns its address in the mapping.
+ * The operating system then writes the pages back at any time, so nothing is held, and the hook never runs.
+ *
+ * @attention The file must be opened before the pool is used, and must outlive the pool.
+ * @attention All dirty frames must be flushed before the file is closed.
+ */
+class BufferPool {
+ private:
+  struct Frame {
+    unsigned int page = 0; // the index of the page held by the frame, 0 means the frame is empty
+    unsigned int pin_count = 0; // the number of users of the frame
+    bool dirty = false; // whether the frame differs from the file
+    bool held = false; // whether the frame has been modified since the last release, only after holdChanges
+    std::list<unsigned int>::iterator lru_pos; // the position of the frame in its list, only if it is unpinned
+    Page data; // the content of the page
+  };
+  File &file_; // the file
+  const size_t base_; // the position of the first page in the file, in bytes
+  size_t limit_ = SIZE_MAX; // bytes at or beyond this position are not written back
+  std::deque<Frame> frames_; // the frames, a deque so that frames stay in place when the pool grows
+  std::unordered_map<unsigned int, unsigned int> page_table_; // page index -> frame index
+  std::list<unsigned int> clean_lru_; // unpinned clean or empty frames, the most recently used frame comes first
+  std::list<unsigned int> dirty_lru_; // unpinned dirty frames that are not held, the most recently used frame comes first
+  std::list<unsigned int> held_; // unpinned held frames, never evicted
+  bool hold_ = false; // whether modified pages are held until release
+  std::function<void()> before_write_back_; // called before pages are written back, may be empty
+  unsigned int last_miss_ = 0; // the last page read from the file, to detect sequential access
+  static constexpr unsigned int kReadAhead = 32; // the maximum number of pages read at once
+  static constexpr int kMaxBatch = 256; // the maximum number of pages written at once
+  unsigned int load(unsigned int n); // read the n-th page, and maybe the following pages, into frames. Return the frame of the n-th page.
+  void writeFrame(Frame &frame); // write the frame back to the file, and mark it as clean
+  [[nodiscard]] size_t position(unsigned int n) const { return base_ + static_cast<size_t>(n - 1) * kPageSize; }
+  std::list<unsigned int> &lru(const Frame &frame) { // the list of an unpinned frame
+    return frame.held ? held_ : frame.dirty ? dirty_lru_ : clean_lru_;
+  }
+  void modify(Frame &frame); // mark the frame as dirty, and as held after holdChanges
+  unsigned int victim(); // get an empty frame, evicting a page if necessary. Clean pages are evicted first. The frame is removed from the lists.
+ public:
+  /**
+   * @brief Construct a new BufferPool object.
+   *
+   * @param file The file that the pages belong to.
+   * @param frame_count The number of frames, must be positive.
+   * @param base The position of the first page in the file, in bytes.
+   */
+  BufferPool(File &file, unsigned int frame_count, size_t base = kPageSize);
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+  ~BufferPool() = default;
+  /**
+   * @brief Pin the n-th page, reading it into a frame if it is not resident.
+   *
+   * @param n The index of the page, must be positive.
+   * @param reset Whether to reset page content into 0 instead of reading it. A reset page is marked as dirty.
+   * @return int* The frame holding the page, valid until the page is unpinned, or until the file grows if it is memory mapped.
+   *
+   * @throw std::runtime_error If all frames are pinned, and none is held.
+   */
+  int *pin(unsigned int n, bool reset = false);
+  /**
+   * @brief Unpin the n-th page.
+   *
+   * @param n The index of the page.
+   * @param dirty Whether the frame has been modified.
+   *
+   * @attention The page must be pinned.
+   */
+  void unpin(unsigned int n, bool dirty);
+  /**
+   * @brief Read the n-th page from the file, bypassing the frames.
+   *
+   * @details Several threads may read pages at once, as long as no page is written meanwhile.
+   *
+   * @param n The index of the page, 1-based.
+   * @param dest The destination.
+   */
+  void read(unsigned int n, int *dest) { file_.read(position(n), dest, kPageSize); }
+  /**
+   * @brief Write all dirty frames back to the file, including the held ones. The pages stay resident.
+   */
+  void flush();
+  /**
+   * @brief Drop all pages without writing them back.
+   */
+  void clear();
+  /**
+   * @brief Set the logical size of the file. Bytes at or beyond it are not written back.
+   * @param size The logical size of the file, in bytes.
+   */
+  void limit(size_t size) { limit_ = size; }
+  /**
+   * @brief Hold the pages modified from now on in memory until `release`, instead of evicting them.
+   */
+  void holdChanges() { hold_ = true; }
+  /**
+   * @brief Let the held pages be evicted, e.g. once their changes are committed in the write-ahead log.
+   * @attention Pages pinned meanwhile stay held until the next release.
+   */
+  void release();
+  /**
+   * @brief Set the function called before dirty pages are written back, by eviction or by `flush`.
+   * @param hook The function, or an empty function to remove the hook.
+   */
+  void beforeWriteBack(std::function<void()> hook) { before_write_back_ = std::move(hook); }
+  /**
+   * @brief Check whether the n-th page is resident.
+   */
+  [[nodiscard]] bool contains(unsigned int n) const;
+};
 /**
  * @brief A class for storing a list of elements in external memory.
  *
@@ -32,6 +168,12 @@ concept ListElement = requires(T t) {
  *
  * `initialize` must be called before using the list.
  *
+ * The elements are packed in the file, so an element may span two pages.
+ * The pages are cached by a buffer pool of `frame_count` frames, which bounds the memory used by the list.
+ * Only dirty pages are written back, when they are evicted or when the list is flushed.
+ *
+ * If the file is memory mapped, the elements are accessed directly in the mapping, and the buffer pool is not used.
+ *
  * @tparam Elem The type of the elements.
  * @tparam recover_space Whether to recover space.
  *
@@ -41,8 +183,7 @@ concept ListElement = requires(T t) {
 template<ListElement Elem, bool recover_space = true>
 class List {
  private:
-  const std::string file_name_; // name (and path) of the file
-  std::fstream file_; // the file
+  File file_; // the file
   static constexpr unsigned int
       byte_size_ = Elem::byte_size(); // size of each element when stored in external file, in bytes
   static constexpr unsigned int
@@ -52,19 +193,26 @@ class List {
     Bytes() = default;
     explicit Bytes(const Elem &elem) { elem.toBytes(data); }
   }; // a byte array
+  BufferPool pool_; // the page cache, only for files that are not memory mapped
   unsigned int size_ = 0; // the current maximum index of the elements
   unsigned int free_head_ = 0; // the head of the free elements
-  bool cached_ = false; // whether the whole list is cached
-  std::vector<Bytes> cache_; // the cache
+  [[nodiscard]] static constexpr size_t position(unsigned int n) { return data_begin_ + static_cast<size_t>(n - 1) * byte_size_; }
+  [[nodiscard]] char *mapped(unsigned int n) { return file_.data() + position(n); } // only for mapped files
+  void read(size_t pos, void *dest, size_t len); // read bytes through the buffer pool
+  void write(size_t pos, const void *src, size_t len); // write bytes through the buffer pool
+  void resize(unsigned int n); // set size_ to n, and update the limit of the buffer pool
   void getHead(unsigned int n, unsigned int &dest); // get the first 4 bytes of the n-th element
   void setHead(unsigned int n, unsigned int value); // set the first 4 bytes of the n-th element
  public:
+  static constexpr unsigned int kDefaultFrameCount = 64; // the default number of frames in the buffer pool
   /**
    * @brief Construct a new List object.
    *
    * @param file_name The name (and path) of the file.
+   * @param frame_count The number of pages cached in memory, must be positive.
    */
-  explicit List(const std::string &file_name = "list") : file_name_(file_name + kFileExtension) {};
+  explicit List(const std::string &file_name = "list", unsigned int frame_count = kDefaultFrameCount)
+      : file_(file_name + kFileExtension), pool_(file_, frame_count, data_begin_) {};
   /**
    * @brief Destroy the List object.
    * @details
@@ -122,21 +270,41 @@ class List {
    */
   void erase(unsigned n);
   /**
-   * @brief Cache the whole list.
-   *
-   * @details
-   * The whole list is read into the cache.
-   * Subsequent operations will be performed on the cache.
+   * @brief Extend the list to at least n elements.
+   * @details The new elements are filled with zero bytes. They are not put into the free list.
+   * @param n The minimum size of the list.
    */
-  void cache();
+  void extend(unsigned int n);
   /**
-   * @brief Write the cache back to the file.
+   * @brief Forget all erased elements.
+   * @details Used to rebuild the free list by erasing the unused elements again, when the stored free list may be stale.
+   */
+  void resetFreeList();
+  /**
+   * @brief Write the dirty pages and the head of the free elements back to the file.
    *
    * @details
-   * The whole list is written back to the file.
-   * Subsequent operations will be performed on the file.
+   * The pages stay cached.
    */
   void flush();
+  /**
+   * @brief Hold the pages modified from now on in memory until `release`, see `BufferPool::holdChanges`.
+   */
+  void holdChanges() { pool_.holdChanges(); }
+  /**
+   * @brief Let the held pages be written back, see `BufferPool::release`.
+   */
+  void release() { pool_.release(); }
+  /**
+   * @brief Set the function called before dirty pages are written back, see `BufferPool::beforeWriteBack`.
+   * @param hook The function.
+   */
+  void beforeWriteBack(std::function<void()> hook) { pool_.beforeWriteBack(std::move(hook)); }
+  /**
+   * @brief Write the file to the disk, see `File::sync`.
+   * @attention Only what has been flushed is written.
+   */
+  void sync() { file_.sync(); }
   /**
    * @brief Get the current maximum index of the elements, 1-based. When `recover_space` is `false`, this is the size of the list.
    *
@@ -146,26 +314,56 @@ class List {
 };
 template<ListElement Elem, bool recover_space>
 void List<Elem, recover_space>::flush() {
-  if (cached_) {
-    file_.seekp(data_begin_, std::ios::beg);
-    for (unsigned int i = 0; i < size_; ++i) {
-      file_.write(cache_[i].data, byte_size_);
-    }
-    cached_ = false;
+  pool_.flush(); // the head of the free elements only changes along with a page, so the hook has run for it
+  if constexpr (recover_space) {
+    file_.write(0, &free_head_, sizeof(unsigned int));
   }
+  file_.flush();
 }
 template<ListElement Elem, bool recover_space>
-void List<Elem, recover_space>::cache() {
-  if (!cached_) {
-    cache_.resize(size_);
-    file_.seekg(data_begin_, std::ios::beg);
-    for (unsigned int i = 0; i < size_; ++i) {
-      file_.read(cache_[i].data, byte_size_);
-    }
-    cached_ = true;
+void List<Elem, recover_space>::read(size_t pos, void *dest, size_t len) {
+  char *out = static_cast<char *>(dest);
+  pos -= data_begin_;
+  while (len) {
+    unsigned int n = pos / kPageSize + 1;
+    size_t offset = pos % kPageSize, count = std::min<size_t>(len, kPageSize - offset);
+    memcpy(out, reinterpret_cast<char *>(pool_.pin(n)) + offset, count);
+    pool_.unpin(n, false);
+    pos += count;
+    out += count;
+    len -= count;
   }
 }
 template<ListElement Elem, bool recover_space>
+void List<Elem, recover_space>::write(size_t pos, const void *src, size_t len) {
+  const char *in = static_cast<const char *>(src);
+  pos -= data_begin_;
+  while (len) {
+    unsigned int n = pos / kPageSize + 1;
+    size_t offset = pos % kPageSize, count = std::min<size_t>(len, kPageSize - offset);
+    memcpy(reinterpret_cast<char *>(pool_.pin(n)) + offset, in, count);
+    pool_.unpin(n, true);
+    pos += count;
+    in += count;
+    len -= count;
+  }
+}
+template<ListElement Elem, bool recover_space>
+void List<Elem, recover_space>::resize(unsigned int n) {
+  size_ = n;
+  pool_.limit(position(n + 1));
+}
+template<ListElement Elem, bool recover_space>
+void List<Elem, recover_space>::extend(unsigned int n) {
+  if (n <= size_) return;
+  file_.reserve(position(n + 1));
+  resize(n);
+}
+template<ListElement Elem, bool recover_space>
+void List<Elem, recover_space>::resetFreeList() {
+  free_head_ = 0;
+}
+template<ListElement Elem, bool recover_space>
 void List<Elem, recover_space>::erase(unsigned int n) {
   if constexpr (recover_space) {
     setHead(n, free_head_);
@@ -174,33 +372,32 @@ void List<Elem, recover_space>::erase(unsigned int n) {
 }
 template<ListElement Elem, bool recover_space>
 void List<Elem, recover_space>::setHead(unsigned int n, unsigned int value) {
-  if (cached_) {
-    *reinterpret_cast<unsigned int *>(cache_[n - 1].data) = value;
+  if (file_.mapped()) {
+    memcpy(mapped(n), &value, sizeof(unsigned int));
   } else {
-    file_.seekp(data_begin_ + (n - 1) * byte_size_, std::ios::beg);
-    file_.write(reinterpret_cast<char *>(&value), sizeof(unsigned int));
+    write(position(n), &value, sizeof(unsigned int));
   }
 }
 template<ListElement Elem, bool recover_space>
 void List<Elem, recover_space>::getHead(unsigned int n, unsigned int &dest) {
-  if (cached_) {
-    dest = *reinterpret_cast<unsigned int *>(cache_[n - 1].data);
+  if (file_.mapped()) {
+    memcpy(&dest, mapped(n), sizeof(unsigned int));
   } else {
-    file_.seekg(data_begin_ + (n - 1) * byte_size_, std::ios::beg);
-    file_.read(reinterpret_cast<char *>(&dest), sizeof(unsigned int));
+    read(position(n), &dest, sizeof(unsigned int));
   }
 }
 template<ListElement Elem, bool recover_space>
 unsigned int List<Elem, recover_space>::insert(const Elem &value) {
   if (!recover_space || free_head_ == 0) {
-    if (cached_) {
-      cache_.emplace_back(value);
+    resize(size_ + 1);
+    if (file_.mapped()) {
+      file_.reserve(position(size_ + 1));
+      value.toBytes(mapped(size_));
     } else {
-      file_.seekp(0, std::ios::end);
       Bytes tmp(value);
-      file_.write(tmp.data, byte_size_);
+      write(position(size_), tmp.data, byte_size_);
     }
-    return ++size_;
+    return size_;
   } else {
     unsigned int n = free_head_;
     getHead(free_head_, free_head_);
@@ -210,66 +407,52 @@ unsigned int List<Elem, recover_space>::insert(const Elem &value) {
 }
 template<ListElement Elem, bool recover_space>
 void List<Elem, recover_space>::set(unsigned int n, const Elem &value) {
-  if (cached_) {
-    value.toBytes(cache_[n - 1].data);
+  if (file_.mapped()) {
+    value.toBytes(mapped(n));
   } else {
     Bytes tmp(value);
-    file_.seekp(data_begin_ + (n - 1) * byte_size_, std::ios::beg);
-    file_.write(tmp.data, byte_size_);
+    write(position(n), tmp.data, byte_size_);
   }
 }
 template<ListElement T, bool recover_space>
 T List<T, recover_space>::get(unsigned int n) {
-  if (cached_) {
-    return T(cache_[n - 1].data);
+  if (file_.mapped()) {
+    return T(mapped(n));
   } else {
     Bytes tmp;
-    file_.seekg(data_begin_ + (n - 1) * byte_size_, std::ios::beg);
-    file_.read(tmp.data, byte_size_);
+    read(position(n), tmp.data, byte_size_);
     return T(tmp.data);
   }
 }
 template<ListElement T, bool recover_space>
 void List<T, recover_space>::get(unsigned int n, T &dest) {
-  if (cached_) {
-    dest.fromBytes(cache_[n - 1].data);
+  if (file_.mapped()) {
+    dest.fromBytes(mapped(n));
   } else {
     Bytes tmp;
-    file_.seekg(data_begin_ + (n - 1) * byte_size_, std::ios::beg);
-    file_.read(tmp.data, byte_size_);
+    read(position(n), tmp.data, byte_size_);
     dest.fromBytes(tmp.data);
   }
 }
 template<ListElement T, bool recover_space>
 void List<T, recover_space>::initialize(bool reset) {
-  if (reset) {
-    file_.open(file_name_, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
-  } else {
-    file_.open(file_name_, std::ios::in | std::ios::out | std::ios::binary);
-  }
-  if (!file_.is_open()) {
-    throw std::runtime_error("Cannot open file " + file_name_);
-  }
+  file_.open(reset);
+  pool_.clear();
   if constexpr (recover_space) {
     if (reset) {
       free_head_ = 0;
-      file_.write(reinterpret_cast<char *>(&free_head_), sizeof(unsigned int));
+      file_.write(0, &free_head_, sizeof(unsigned int));
     } else {
-      file_.read(reinterpret_cast<char *>(&free_head_), sizeof(unsigned int));
+      file_.read(0, &free_head_, sizeof(unsigned int));
     }
   }
-  if (reset) size_ = 0;
+  if (reset || file_.size() < data_begin_) resize(0); // the header may be missing if the last run crashed
   else {
-    file_.seekg(0, std::ios::end);
-    size_ = (static_cast<unsigned int>(file_.tellg()) - data_begin_) / byte_size_;
+    resize((file_.size() - data_begin_) / byte_size_);
   }
 }
 template<ListElement T, bool recover_space>
 List<T, recover_space>::~List() {
-  if constexpr (recover_space) {
-    file_.seekp(0);
-    file_.write(reinterpret_cast<char *>(&free_head_), sizeof(unsigned int));
-  }
   flush();
   file_.close();
 }
@@ -281,23 +464,36 @@ List<T, recover_space>::~List() {
  *
  * `initialize` must be called before using the list.
  *
+ * If the file is memory mapped, the integers are accessed directly in the mapping, and `cache` does nothing.
+ *
+ * When the list is cached, it is kept in blocks of `kIntegerPerPage` integers, and modified elements are tracked by block.
+ * `checkpoint` and `flush` write back only the dirty blocks, each run of consecutive dirty blocks with a single write.
+ * A block that has only ever held zeros (e.g. after `resize`) is not allocated until an element of it is set,
+ * so growing a cached list costs nothing until the new elements are used.
+ *
  * @attention The list is 0-indexed.
  * @attention No bound checking is performed.
  */
 class Array {
  private:
   unsigned int size_; // number of elements
-  const std::string file_name_; // name (and path) of the file
-  std::fstream file_; // the file
+  File file_; // the file
   bool cached_; // whether the whole list is cached
-  std::vector<int> cache_; // the cache
+  std::vector<std::unique_ptr<int[]>> cache_; // the cached blocks of kIntegerPerPage integers, nullptr for a block of zeros
+  std::vector<bool> dirty_; // whether each block of kIntegerPerPage integers in the cache differs from the file
+  std::vector<bool> loaded_; // whether each block of the cache has been read from the file, see `cache`
+  static constexpr int kMaxBatch = 256; // the maximum number of blocks read or written at once
+  [[nodiscard]] int *mapped() { return reinterpret_cast<int *>(file_.data()); } // only for mapped files
+  void markDirty(unsigned int begin, unsigned int end); // mark the elements [begin, end) as dirty, only for cached lists
+  int *block(unsigned int n); // the block of the n-th element, allocated if necessary, only for cached lists
+  const int *load(unsigned int i); // read the i-th block from the file into the cache, only for cached lists
  public:
   /**
    * @brief Construct a new Array object.
    *
    * @param name The name (and path) of the file.
    */
-  explicit Array(std::string name = "array") : size_(0), file_name_(std::move(name) + kFileExtension), cached_() {}
+  explicit Array(std::string name = "array") : size_(0), file_(std::move(name) + kFileExtension), cached_() {}
   Array(const Array &) = delete;
   Array &operator=(const Array &) = delete;
   /**
@@ -352,18 +548,32 @@ class Array {
    * @brief Cache the whole list.
    *
    * @details
-   * The whole list is read into the cache.
+   * The whole list is read into the cache, or, if `lazy` is true, each block is read when it is first accessed.
    * Subsequent operations will be performed on the cache.
+   *
+   * @param lazy Whether to read the blocks on demand, so that caching takes constant time.
    */
-  void cache();
+  void cache(bool lazy = false);
+  /**
+   * @brief Write the dirty blocks of the cache back to the file. The list stays cached.
+   *
+   * @details
+   * The file is never truncated before the new content is written, so it is valid at any time.
+   */
+  void checkpoint();
   /**
    * @brief Write the cache back to the file.
    *
    * @details
-   * The whole list is written back to the file.
+   * The dirty blocks are written back to the file, see `checkpoint`.
    * Subsequent operations will be performed on the file.
    */
   void flush();
+  /**
+   * @brief Write the file to the disk, see `File::sync`.
+   * @attention Only what has been written back is written.
+   */
+  void sync() { file_.sync(); }
   /**
    * @brief Append a copy of the list to the end of the file, doubling the size of the file.
    *
@@ -374,6 +584,15 @@ class Array {
    *
    */
   void halve_size();
+  /**
+   * @brief Change the size of the list.
+   *
+   * @details
+   * New elements are 0. Neither the file nor the cache is written until the new elements are set.
+   *
+   * @param size The new size.
+   */
+  void resize(unsigned int size);
 };
 /**
  * @brief A class for storing pages of integers in external memory.
@@ -391,24 +610,25 @@ class Array {
  * @attention No bound checking is performed.
  *
  * @note The info page is implicitly cached.
+ * @note The other pages are cached by a buffer pool of `frame_count` frames.
  */
 class Pages {
  private:
   unsigned int size_; // number of pages
-  const std::string file_name_; // name (and path) of the file
-  std::fstream file_; // the file
-  unsigned int cache_index_; // the index of the cached page
-  Page cache_; // the cache
+  File file_; // the file
+  BufferPool pool_; // the page cache
   Page info_; // the info page
   int &free_head_ = info_[0]; // the head of the free pages
  public:
+  static constexpr unsigned int kDefaultFrameCount = 64; // the default number of frames in the buffer pool
   /**
    * @brief Construct a new Pages object.
    *
    * @param name The name (and path) of the file.
+   * @param frame_count The number of pages cached in memory, must be positive.
    */
-  explicit Pages(std::string name = "pages")
-      : size_(), file_name_(std::move(name) + kFileExtension), cache_index_(), cache_(), info_() {}
+  explicit Pages(std::string name = "pages", unsigned int frame_count = kDefaultFrameCount)
+      : size_(), file_(std::move(name) + kFileExtension), pool_(file_, frame_count), info_() {}
   Pages(const Pages &) = delete;
   Pages &operator=(const Pages &) = delete;
   /**
@@ -416,7 +636,7 @@ class Pages {
    *
    * @details
    * The destructor closes the file.
-   * If the cache is not empty, the cache is written back to the file.
+   * Dirty pages in the cache are written back to the file.
    */
   ~Pages();
   /**
@@ -477,9 +697,32 @@ class Pages {
    */
   void fetchPage(unsigned int n, bool reset = false);
   /**
-   * @brief Flush the page cache back to the file.
+   * @brief Pin the n-th page in the cache, and get direct access to it.
+   *
+   * @param n The index of the page, 1-based.
+   * @param reset Whether to reset page content into 0.
+   * @return int* The cached page, valid until `unpinPage` is called, or until a new page is allocated if the file is memory mapped.
+   *
+   * @attention Every call must be paired with a call to `unpinPage`.
+   * @attention No bound checking is performed.
+   */
+  int *pinPage(unsigned int n, bool reset = false);
+  /**
+   * @brief Unpin the n-th page.
+   *
+   * @param n The index of the page, 1-based.
+   * @param dirty Whether the page has been modified through the pointer returned by `pinPage`.
+   */
+  void unpinPage(unsigned int n, bool dirty);
+  /**
+   * @brief Write the dirty pages in the cache back to the file.
    */
   void flush();
+  /**
+   * @brief Write the file to the disk, see `File::sync`.
+   * @attention Only what has been flushed is written.
+   */
+  void sync() { file_.sync(); }
   /**
    * @brief Get the n-th page, 1-based.
    *
@@ -489,6 +732,18 @@ class Pages {
    * @attention No bound checking is performed.
    */
   void getPage(unsigned n, int *dest);
+  /**
+   * @brief Read the n-th page directly from the file, bypassing the cache.
+   *
+   * @details
+   * Several threads may read pages at once, as long as no page is modified meanwhile.
+   *
+   * @param n The index of the page, 1-based.
+   * @param dest The destination.
+   *
+   * @attention Modified pages in the cache are not seen, they must be written back by `flush` first.
+   */
+  void readPage(unsigned n, int *dest);
   /**
    * @brief Set the n-th page, 1-based.
    *
@@ -546,6 +801,16 @@ class Pages {
    * @note The new page is cleared and fetched into the cache.
    */
   unsigned int newPage(const int *value = nullptr);
+  /**
+   * @brief Allocate consecutive new pages at the end of the file.
+   *
+   * @param count The number of pages.
+   * @return unsigned int The index of the first page, 1-based.
+   *
+   * @note The file is extended to hold the pages, which read as 0 until they are written.
+   * @note The pages are not fetched into the cache. The free pages are not used.
+   */
+  unsigned int newPages(unsigned int count);
   /**
    * @brief Deallocate a page.
    *
@@ -2,24 +2,32 @@
 // Created by zj on 12/2/2023.
 //
 
+#include <array>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include "external_vector.h"
 namespace external_memory {
 void Vectors::initialize(bool reset) {
   info_.initialize(reset);
   data_.initialize(reset);
-  info_.cache();
-  for (unsigned int i = 1; i <= info_.size() / kInfoPerPage; ++i) {
-    int capacity = getPageInfo(kPageInfo::kCapacity, i);
-    if (capacity > 0 && capacity < kIntegerPerPage) {
-      int unoccupied_beg = getPageInfo(kPageInfo::kUnoccupiedBeg, i);
-      if (unoccupied_beg != kIntegerPerPage) {
-        unsigned int capacity_log = __builtin_ctz(capacity);
-        auto &tmp = free_pages_of_capacity_[capacity_log];
-        tmp.insert(tmp.end(), i);
-      }
-    }
+  info_.cache(true);
+  if (reset) {
+    layout_ = kLayoutVersion;
+  } else if (layout_ != kLayoutVersion) {
+    throw std::runtime_error(file_name_ + " has the layout version " + std::to_string(layout_) + " instead of "
+                                 + std::to_string(kLayoutVersion) + ", the database has to be rebuilt");
   }
 }
+void Vectors::checkpoint() {
+  info_.checkpoint();
+  data_.flush();
+  data_.flushInfo();
+}
+void Vectors::sync() {
+  info_.sync();
+  data_.sync();
+}
 int Vectors::getPageInfo(Vectors::kPageInfo type, unsigned int n) {
   return info_.get((n - 1) * kInfoPerPage + static_cast<unsigned int>(type));
 }
@@ -30,14 +38,32 @@ void Vectors::deletePage(unsigned int n) {
   setPageInfo(kPageInfo::kCapacity, n, 0);
   setPageInfo(kPageInfo::kFreeHead, n, 0);
   setPageInfo(kPageInfo::kUnoccupiedBeg, n, 0);
+  setPageInfo(kPageInfo::kLength, n, 0);
+  setPageInfo(kPageInfo::kPrevFree, n, 0);
   data_.deletePage(n);
 }
+void Vectors::linkFreePage(unsigned int n, unsigned int capacity_log) {
+  int &head = freePages(capacity_log);
+  setPageInfo(kPageInfo::kNextFree, n, head);
+  setPageInfo(kPageInfo::kPrevFree, n, 0);
+  if (head) setPageInfo(kPageInfo::kPrevFree, head, static_cast<int>(n));
+  head = static_cast<int>(n);
+}
+void Vectors::unlinkFreePage(unsigned int n, unsigned int capacity_log) {
+  int next = getPageInfo(kPageInfo::kNextFree, n);
+  int prev = getPageInfo(kPageInfo::kPrevFree, n);
+  if (prev) setPageInfo(kPageInfo::kNextFree, prev, next);
+  else freePages(capacity_log) = next;
+  if (next) setPageInfo(kPageInfo::kPrevFree, next, prev);
+  setPageInfo(kPageInfo::kNextFree, n, 0);
+  setPageInfo(kPageInfo::kPrevFree, n, 0);
+}
 Vectors::Vector Vectors::getVector(unsigned int pos) {
   if (!pos) {
     return Vector(*this);
   }
   auto ret = Vector(*this, pos);
-  if (ret.capacity() <= kIntegerPerPage) {
+  if (ret.slots() <= kIntegerPerPage) {
     data_.fetchPage(ret.page_id_);
   }
   return ret;
@@ -47,16 +73,15 @@ Vectors::Vector Vectors::newVector() {
 }
 unsigned int Vectors::getPageOfCapacity(unsigned int capacity) {
   unsigned capacity_log = __builtin_ctz(capacity);
-  auto &tmp = free_pages_of_capacity_[capacity_log];
-  if (tmp.empty()) {
+  if (!freePages(capacity_log)) {
     auto new_page = newPage();
     setPageInfo(kPageInfo::kCapacity, new_page, capacity);
     setPageInfo(kPageInfo::kFreeHead, new_page, -1);
     setPageInfo(kPageInfo::kUnoccupiedBeg, new_page, 0);
-    tmp.insert(new_page);
+    linkFreePage(new_page, capacity_log);
     return new_page;
   } else {
-    return *tmp.begin();
+    return freePages(capacity_log);
   }
 }
 unsigned int Vectors::newPage() {
@@ -68,6 +93,44 @@ unsigned int Vectors::newPage() {
   }
   return new_page;
 }
+unsigned int Vectors::newPages(unsigned int count) {
+  if (count == 1) {
+    return newPage();
+  }
+  int &free_extents = freeExtents(__builtin_ctz(count));
+  if (free_extents) {
+    unsigned first = free_extents;
+    free_extents = getPageInfo(kPageInfo::kNextFree, first);
+    setPageInfo(kPageInfo::kCapacity, first, 0);
+    setPageInfo(kPageInfo::kNextFree, first, 0);
+    return first;
+  }
+  unsigned first = data_.newPages(count);
+  if (first + count - 1 > info_.size() / kInfoPerPage) {
+    info_.resize((first + count - 1) * kInfoPerPage);
+  }
+  return first;
+}
+void Vectors::deletePages(unsigned int n, unsigned int count) {
+  if (count == 1) {
+    deletePage(n);
+    return;
+  }
+  int &free_extents = freeExtents(__builtin_ctz(count));
+  setPageInfo(kPageInfo::kCapacity, n, kFreeExtent);
+  setPageInfo(kPageInfo::kNextPage, n, 0);
+  setPageInfo(kPageInfo::kNextFree, n, free_extents);
+  free_extents = static_cast<int>(n);
+}
+unsigned int Vectors::extentPages(unsigned int k) {
+  return k == 0 ? 1 : k <= kMaxExtentLog ? 1u << (k - 1) : kMaxExtentPages;
+}
+unsigned int Vectors::extentBegin(unsigned int k) {
+  return k == 0 ? 0 : k <= kMaxExtentLog + 1 ? 1u << (k - 1) : kMaxExtentPages * (k - kMaxExtentLog);
+}
+unsigned int Vectors::extentOf(unsigned int n) {
+  return n < kMaxExtentPages ? std::bit_width(n) : n / kMaxExtentPages + kMaxExtentLog;
+}
 unsigned int Vectors::allocate(unsigned int capacity) {
   if (capacity < kIntegerPerPage) {
     unsigned int page = getPageOfCapacity(capacity);
@@ -80,13 +143,13 @@ unsigned int Vectors::allocate(unsigned int capacity) {
       setPageInfo(kPageInfo::kFreeHead, page, new_free_head);
       clearSpace(capacity, page, free_head);
       if (new_free_head == -1 && unoccupied_beg == kIntegerPerPage) {
-        free_pages_of_capacity_[__builtin_ctz(capacity)].erase(page);
+        unlinkFreePage(page, __builtin_ctz(capacity));
       }
       return external_memory::Pages::toPosition(page, free_head);
     } else {
       setPageInfo(kPageInfo::kUnoccupiedBeg, page, unoccupied_beg + capacity);
       if (unoccupied_beg + capacity == kIntegerPerPage) {
-        free_pages_of_capacity_[__builtin_ctz(capacity)].erase(page);
+        unlinkFreePage(page, __builtin_ctz(capacity));
       }
       clearSpace(capacity, page, unoccupied_beg);
       return external_memory::Pages::toPosition(page, unoccupied_beg);
@@ -97,6 +160,7 @@ unsigned int Vectors::allocate(unsigned int capacity) {
     setPageInfo(kPageInfo::kCapacity, page, capacity);
     setPageInfo(kPageInfo::kNextPage, page, 0);
     setPageInfo(kPageInfo::kLastPage, page, page);
+    setPageInfo(kPageInfo::kLength, page, 0);
     return external_memory::Pages::toPosition(page, 0);
   }
 }
@@ -113,18 +177,19 @@ void Vectors::deallocate(unsigned int page, unsigned int offset, unsigned int ca
     int free_head = getPageInfo(kPageInfo::kFreeHead, page);
     int unoccupied_beg = getPageInfo(kPageInfo::kUnoccupiedBeg, page);
     data_.fetchPage(page);
+    bool full = free_head == -1 && unoccupied_beg == kIntegerPerPage; // i.e. not in the list of pages with free space
     if (offset + capacity == unoccupied_beg) {
       setPageInfo(kPageInfo::kUnoccupiedBeg, page, offset);
       if (offset == 0) {
+        unlinkFreePage(page, __builtin_ctz(capacity));
         deletePage(page);
-        free_pages_of_capacity_[__builtin_ctz(capacity)].erase(page);
         return;
       }
     } else {
       setPageInfo(kPageInfo::kFreeHead, page, offset);
       data_.setPart(page, offset, 1, &free_head);
     }
-    free_pages_of_capacity_[__builtin_ctz(capacity)].insert(page);
+    if (full) linkFreePage(page, __builtin_ctz(capacity));
   } else {
     deletePage(page);
   }
@@ -132,119 +197,200 @@ void Vectors::deallocate(unsigned int page, unsigned int offset, unsigned int ca
 unsigned int Vectors::Vector::getPos() const {
   return pos_;
 }
+template<class Function>
+void Vectors::Vector::forEachPage(unsigned int begin, unsigned int end, Function function) {
+  unsigned n = begin / kIntegerPerPage; // the index of the page within the vector
+  unsigned k = extentOf(n);
+  unsigned extent = extentAt(k);
+  for (unsigned page = extent + n - extentBegin(k); begin < end;) {
+    unsigned offset = begin % kIntegerPerPage;
+    unsigned len = std::min(kIntegerPerPage - offset, end - begin);
+    function(page, offset, len);
+    begin += len;
+    if (++n == extentBegin(k + 1) && begin < end) {
+      extent = vectors_.getPageInfo(kPageInfo::kNextPage, extent);
+      page = extent;
+      ++k;
+    } else {
+      ++page;
+    }
+  }
+}
 std::vector<int> Vectors::Vector::getData() {
-  if (!pos_) {
+  unsigned int size = this->size();
+  if (!size) {
     return {};
   }
-  unsigned capacity = this->capacity();
-  std::vector<int> ret(capacity);
-  if (capacity <= kIntegerPerPage) {
-    vectors_.data_.getPart(page_id_, offset_, capacity, ret.data());
-  } else {
-    unsigned page = page_id_;
-    int *data = ret.data();
-    while (page) {
-      vectors_.data_.getPage(page, data);
-      data += kIntegerPerPage;
-      page = vectors_.getPageInfo(kPageInfo::kNextPage, page);
-    }
+  std::vector<int> ret(size);
+  if (slots() < kIntegerPerPage) {
+    vectors_.data_.getPart(page_id_, offset_ + 1, size, ret.data());
+    return ret;
   }
-  while (!ret.empty() && ret.back() == 0) {
-    ret.pop_back();
+  int *data = ret.data();
+  forEachPage(0, size, [this, &data](unsigned page, unsigned offset, unsigned len) {
+    vectors_.data_.getPart(page, offset, len, data); // the pages of an extent are consecutive, and are read ahead
+    data += len;
+  });
+  return ret;
+}
+std::vector<int> Vectors::Vector::getData(unsigned int begin, unsigned int end) {
+  std::vector<int> ret(end - begin);
+  if (ret.empty()) {
+    return ret;
   }
+  if (slots() < kIntegerPerPage) {
+    vectors_.data_.getPart(page_id_, offset_ + 1 + begin, end - begin, ret.data());
+    return ret;
+  }
+  int *data = ret.data();
+  forEachPage(begin, end, [this, &data](unsigned page, unsigned offset, unsigned len) {
+    vectors_.data_.getPart(page, offset, len, data);
+    data += len;
+  });
   return ret;
 }
-unsigned int Vectors::Vector::capacity() const {
+unsigned int Vectors::Vector::extentAt(unsigned int k) const {
+  if (k == extentOf(slots() / kIntegerPerPage - 1)) {
+    return vectors_.getPageInfo(kPageInfo::kLastPage, page_id_);
+  }
+  unsigned extent = page_id_;
+  while (k--) {
+    extent = vectors_.getPageInfo(kPageInfo::kNextPage, extent);
+  }
+  return extent;
+}
+unsigned int Vectors::Vector::pageOf(unsigned int index) const {
+  unsigned n = index / kIntegerPerPage;
+  unsigned k = extentOf(n);
+  return extentAt(k) + n - extentBegin(k);
+}
+unsigned int Vectors::Vector::slots() const {
   return pos_ ? vectors_.getPageInfo(kPageInfo::kCapacity, page_id_) : 0;
 }
+unsigned int Vectors::Vector::capacity() const {
+  unsigned int slots = this->slots();
+  return slots < kIntegerPerPage && slots ? slots - 1 : slots;
+}
+unsigned int Vectors::Vector::size() const {
+  if (!pos_) return 0;
+  if (slots() >= kIntegerPerPage) return vectors_.getPageInfo(kPageInfo::kLength, page_id_);
+  int size;
+  vectors_.data_.getPart(page_id_, offset_, 1, &size);
+  return size;
+}
 bool Vectors::Vector::push_back(int value) {
-  unsigned capacity = this->capacity();
-  if (capacity < kIntegerPerPage) {
-    auto data = getData();
-    data.push_back(value);
-    if (data.size() <= capacity) {
-      vectors_.data_.setPart(page_id_, offset_, data.size(), data.data());
-      return false;
-    } else {
-      if (pos_) {
-        vectors_.deallocate(page_id_, offset_, capacity);
-        updatePos(vectors_.allocate(capacity * 2));
-      } else {
-        updatePos(vectors_.allocate(1));
-      }
-      vectors_.data_.setPart(page_id_, offset_, data.size(), data.data());
-      return true;
-    }
+  unsigned slots = this->slots();
+  unsigned size = this->size();
+  int length = static_cast<int>(size + 1);
+  if (slots >= kIntegerPerPage) { // a large vector is never moved
+    unsigned page = size == slots ? appendExtent() : pageOf(size); // the extents are full, or not
+    if (size % kIntegerPerPage == 0) vectors_.data_.fetchPage(page, true); // nothing to read from an unused page
+    vectors_.data_.setPart(page, size % kIntegerPerPage, 1, &value);
+    vectors_.setPageInfo(kPageInfo::kLength, page_id_, length);
+    return false;
+  }
+  if (size + 1 < slots) {
+    vectors_.data_.setPart(page_id_, offset_ + size + 1, 1, &value);
+    vectors_.data_.setPart(page_id_, offset_, 1, &length);
+    return false;
+  }
+  std::vector<int> data(size + 2); // the length, the elements and the new element
+  if (pos_) {
+    vectors_.data_.getPart(page_id_, offset_, slots, data.data());
+    vectors_.deallocate(page_id_, offset_, slots);
+  }
+  data[0] = length;
+  data[size + 1] = value;
+  updatePos(vectors_.allocate(pos_ ? slots * 2 : kMinSlots));
+  if (slots * 2 == kIntegerPerPage) { // the vector becomes large, and its length goes to the info
+    vectors_.data_.setPart(page_id_, offset_, size + 1, data.data() + 1);
+    vectors_.setPageInfo(kPageInfo::kLength, page_id_, length);
   } else {
-    unsigned int last_page = vectors_.getPageInfo(kPageInfo::kLastPage, page_id_);
-    Page tmp;
-    int first_unoccupied = kIntegerPerPage;
-    vectors_.data_.getPage(last_page, tmp);
-    for (; first_unoccupied > 0 && tmp[first_unoccupied - 1] == 0; --first_unoccupied);
-    if (first_unoccupied < kIntegerPerPage) {
-      tmp[first_unoccupied] = value;
-      vectors_.data_.setPage(last_page, tmp);
-      return false;
-    } else {
-      unsigned int new_page = appendPage();
-      vectors_.data_.setPart(new_page, 0, 1, &value);
-      return false;
-    }
+    vectors_.data_.setPart(page_id_, offset_, data.size(), data.data());
   }
+  return true;
 }
-unsigned int Vectors::Vector::appendPage() {
-  unsigned new_page = vectors_.newPage();
-  unsigned last_page = vectors_.getPageInfo(kPageInfo::kLastPage, page_id_);
+void Vectors::Vector::setData(unsigned int begin, const std::vector<int> &values) {
+  if (values.empty()) {
+    return;
+  }
+  if (slots() < kIntegerPerPage) {
+    vectors_.data_.setPart(page_id_, offset_ + 1 + begin, values.size(), values.data());
+    return;
+  }
+  const int *data = values.data();
+  forEachPage(begin, begin + values.size(), [this, &data](unsigned page, unsigned offset, unsigned len) {
+    vectors_.data_.setPart(page, offset, len, data);
+    data += len;
+  });
+}
+void Vectors::Vector::truncate(unsigned int size) {
+  if (!pos_) {
+    return;
+  }
+  auto length = static_cast<int>(size);
+  unsigned slots = this->slots();
+  if (slots < kIntegerPerPage) {
+    vectors_.data_.setPart(page_id_, offset_, 1, &length);
+    return;
+  }
+  unsigned pages = std::max((size + kIntegerPerPage - 1) / kIntegerPerPage, 1u);
+  if (extentOf(pages - 1) < extentOf(slots / kIntegerPerPage - 1)) {
+    discardAfter(extentOf(pages - 1));
+  }
+  vectors_.setPageInfo(kPageInfo::kLength, page_id_, length);
+}
+unsigned int Vectors::Vector::appendExtent() {
   unsigned capacity = vectors_.getPageInfo(kPageInfo::kCapacity, page_id_);
-  vectors_.setPageInfo(kPageInfo::kCapacity, new_page, -1);
-  vectors_.setPageInfo(kPageInfo::kNextPage, new_page, 0);
-  vectors_.setPageInfo(kPageInfo::kLastPage, new_page, -1);
-  vectors_.setPageInfo(kPageInfo::kNextPage, last_page, new_page);
-  vectors_.setPageInfo(kPageInfo::kLastPage, page_id_, new_page);
-  vectors_.setPageInfo(kPageInfo::kCapacity, page_id_, capacity + kIntegerPerPage);
-  return new_page;
+  unsigned count = extentPages(extentOf(capacity / kIntegerPerPage - 1) + 1);
+  unsigned new_extent = vectors_.newPages(count);
+  for (unsigned page = new_extent; page < new_extent + count; ++page) {
+    vectors_.setPageInfo(kPageInfo::kCapacity, page, -1);
+    vectors_.setPageInfo(kPageInfo::kNextPage, page, 0);
+    vectors_.setPageInfo(kPageInfo::kLastPage, page, -1);
+  }
+  unsigned last_extent = vectors_.getPageInfo(kPageInfo::kLastPage, page_id_);
+  vectors_.setPageInfo(kPageInfo::kNextPage, last_extent, new_extent);
+  vectors_.setPageInfo(kPageInfo::kLastPage, page_id_, new_extent);
+  vectors_.setPageInfo(kPageInfo::kCapacity, page_id_, capacity + count * kIntegerPerPage);
+  return new_extent;
 }
 bool Vectors::Vector::update(std::vector<int> &&data) {
   if (data.empty()) {
     return del();
   }
-  unsigned capacity = this->capacity();
+  unsigned slots = this->slots();
+  auto length = static_cast<int>(data.size());
   bool ret = false;
-  if (capacity < kIntegerPerPage) {
-    if (data.size() <= capacity) {
-      data.resize(capacity);
-      vectors_.data_.setPart(page_id_, offset_, data.size(), data.data());
-      return false;
-    } else {
-      if (data.size() <= kIntegerPerPage) {
-        unsigned new_capacity = 1 << (32 - __builtin_clz(data.size() - 1));
-        data.resize(new_capacity);
-        vectors_.deallocate(page_id_, offset_, capacity);
-        updatePos(vectors_.allocate(new_capacity));
-        vectors_.data_.setPart(page_id_, offset_, data.size(), data.data());
-        return true;
-      } else {
-        vectors_.deallocate(page_id_, offset_, capacity);
-        updatePos(vectors_.allocate(kIntegerPerPage));
+  if (slots < kIntegerPerPage) {
+    unsigned new_slots = std::max(std::bit_ceil(static_cast<unsigned>(data.size() + 1)), kMinSlots);
+    if (new_slots < kIntegerPerPage) {
+      data.insert(data.begin(), length); // the length comes first
+      if (new_slots > slots) {
+        vectors_.deallocate(page_id_, offset_, slots);
+        updatePos(vectors_.allocate(new_slots));
         ret = true;
       }
+      vectors_.data_.setPart(page_id_, offset_, data.size(), data.data());
+      return ret;
     }
+    vectors_.deallocate(page_id_, offset_, slots);
+    updatePos(vectors_.allocate(kIntegerPerPage));
+    ret = true;
+  }
+  vectors_.setPageInfo(kPageInfo::kLength, page_id_, length);
+  unsigned pages = (data.size() + kIntegerPerPage - 1) / kIntegerPerPage;
+  while (this->slots() < pages * kIntegerPerPage) {
+    appendExtent();
   }
-  data.resize((data.size() + kIntegerPerPage - 1) / kIntegerPerPage * kIntegerPerPage);
-  int *data_ptr = data.data();
-  unsigned page = page_id_;
-  unsigned last_page = 0;
-  for (unsigned filled = 0; filled < data.size(); filled += kIntegerPerPage) {
-    last_page = page;
+  data.resize(pages * kIntegerPerPage);
+  const int *data_ptr = data.data();
+  forEachPage(0, data.size(), [this, &data_ptr](unsigned page, unsigned, unsigned) {
     vectors_.data_.setPage(page, data_ptr);
     data_ptr += kIntegerPerPage;
-    page = vectors_.getPageInfo(kPageInfo::kNextPage, page);
-    if (!page && filled + kIntegerPerPage < data.size()) {
-      page = appendPage();
-    }
-  }
-  if (page) {
-    discardAfter(last_page);
+  });
+  if (extentOf(pages - 1) < extentOf(this->slots() / kIntegerPerPage - 1)) {
+    discardAfter(extentOf(pages - 1));
   }
   return ret;
 }
@@ -252,34 +398,293 @@ void Vectors::Vector::updatePos(unsigned int new_pos) {
   pos_ = new_pos;
   std::tie(page_id_, offset_) = external_memory::Pages::toPageOffset(pos_);
 }
-void Vectors::Vector::discardAfter(unsigned int last_page) {
-  if (!last_page) {
-    return;
-  }
-  unsigned capacity = vectors_.getPageInfo(kPageInfo::kCapacity, page_id_);
-  unsigned page = vectors_.getPageInfo(kPageInfo::kNextPage, last_page);
-  vectors_.setPageInfo(kPageInfo::kNextPage, last_page, 0);
-  vectors_.setPageInfo(kPageInfo::kLastPage, page_id_, last_page);
-  while (page) {
-    unsigned next_page = vectors_.getPageInfo(kPageInfo::kNextPage, page);
-    capacity -= kIntegerPerPage;
-    vectors_.deletePage(page);
-    page = next_page;
+void Vectors::Vector::discardAfter(unsigned int last_extent) {
+  unsigned extents = extentOf(slots() / kIntegerPerPage - 1) + 1;
+  unsigned extent = extentAt(last_extent);
+  unsigned next_extent = vectors_.getPageInfo(kPageInfo::kNextPage, extent);
+  vectors_.setPageInfo(kPageInfo::kNextPage, extent, 0);
+  vectors_.setPageInfo(kPageInfo::kLastPage, page_id_, extent);
+  vectors_.setPageInfo(kPageInfo::kCapacity, page_id_, extentBegin(last_extent + 1) * kIntegerPerPage);
+  for (unsigned k = last_extent + 1; k < extents; ++k) {
+    extent = next_extent;
+    next_extent = vectors_.getPageInfo(kPageInfo::kNextPage, extent);
+    vectors_.deletePages(extent, extentPages(k));
   }
-  vectors_.setPageInfo(kPageInfo::kCapacity, page_id_, capacity);
 }
 bool Vectors::Vector::del() {
   if (!pos_) {
     return false;
   }
-  unsigned capacity = this->capacity();
-  if (capacity < kIntegerPerPage) {
-    vectors_.deallocate(page_id_, offset_, capacity);
+  unsigned slots = this->slots();
+  if (slots < kIntegerPerPage) {
+    vectors_.deallocate(page_id_, offset_, slots);
   } else {
-    discardAfter(page_id_);
+    discardAfter(0);
     vectors_.deletePage(page_id_);
   }
   updatePos(0);
   return true;
 }
+namespace {
+struct Shuffle {
+  alignas(16) unsigned char mask[16]; // moves the bytes of the differences to 4 little-endian integers
+  unsigned char length; // the number of bytes of the differences
+};
+constexpr std::array<Shuffle, 256> kShuffles = [] { // indexed by the control byte
+  std::array<Shuffle, 256> shuffles{};
+  for (unsigned control = 0; control < 256; ++control) {
+    unsigned char pos = 0;
+    for (unsigned i = 0; i < 4; ++i) {
+      unsigned length = (control >> (2 * i) & 3) + 1;
+      for (unsigned byte = 0; byte < 4; ++byte) {
+        shuffles[control].mask[4 * i + byte] = byte < length ? pos + byte : 0x80;
+      }
+      pos += length;
+    }
+    shuffles[control].length = pos;
+  }
+  return shuffles;
+}();
+void decodeScalar(const unsigned char *src, unsigned int groups, unsigned int base, unsigned int *dest) {
+  while (groups--) {
+    unsigned control = *src++;
+    for (unsigned i = 0; i < 4; ++i) {
+      unsigned length = (control >> (2 * i) & 3) + 1;
+      unsigned delta = 0;
+      for (unsigned byte = 0; byte < length; ++byte) {
+        delta |= static_cast<unsigned>(src[byte]) << (8 * byte);
+      }
+      src += length;
+      *dest++ = base += delta;
+    }
+  }
+}
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+void decodeSsse3(const unsigned char *src, unsigned int groups, unsigned int base, unsigned int *dest) {
+  __m128i last = _mm_set1_epi32(static_cast<int>(base));
+  while (groups--) {
+    const Shuffle &shuffle = kShuffles[*src++];
+    __m128i deltas = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src)),
+                                      _mm_load_si128(reinterpret_cast<const __m128i *>(shuffle.mask)));
+    deltas = _mm_add_epi32(deltas, _mm_slli_si128(deltas, 4)); // prefix sums
+    deltas = _mm_add_epi32(deltas, _mm_slli_si128(deltas, 8));
+    __m128i values = _mm_add_epi32(deltas, last);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dest), values);
+    last = _mm_shuffle_epi32(values, 0xff);
+    src += shuffle.length;
+    dest += 4;
+  }
+}
+const bool kHasSsse3 = [] {
+  __builtin_cpu_init(); // may run before the constructor that initializes the processor features
+  return __builtin_cpu_supports("ssse3");
+}();
+#endif
+} // namespace
+unsigned int PostingList::encode(const unsigned int *values, unsigned int count, unsigned int base,
+                                 unsigned char *dest) {
+  unsigned char *begin = dest;
+  for (unsigned group = 0; group < count; group += 4) {
+    unsigned char &control = *dest++;
+    control = 0;
+    for (unsigned i = 0; i < 4; ++i) {
+      unsigned delta = values[group + i] - base;
+      base = values[group + i];
+      unsigned length = delta >> 24 ? 4 : delta >> 16 ? 3 : delta >> 8 ? 2 : 1;
+      control |= (length - 1) << (2 * i);
+      memcpy(dest, &delta, sizeof(delta)); // little-endian
+      dest += length;
+    }
+  }
+  return dest - begin;
+}
+void PostingList::decode(const unsigned char *src, unsigned int groups, unsigned int base, unsigned int *dest) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (kHasSsse3) {
+    decodeSsse3(src, groups, base, dest);
+    return;
+  }
+#endif
+  decodeScalar(src, groups, base, dest);
+}
+std::vector<int> PostingList::read(Vectors::Vector &vector) {
+  std::vector<int> data = vector.getData();
+  if (data.empty() || data.back() >= 0) {
+    return data;
+  }
+  return unpack(data);
+}
+std::vector<int> PostingList::unpack(std::vector<int> &data) {
+  unsigned size = -data.back();
+  unsigned grouped = size & ~3u;
+  unsigned bytes = data[data.size() - 2];
+  unsigned groups_end = (bytes + sizeof(int) - 1) / sizeof(int);
+  std::vector<int> ret(size);
+  std::copy_n(data.begin() + groups_end, size - grouped, ret.begin() + grouped);
+  data.resize(groups_end + kPadding / sizeof(int));
+  decode(reinterpret_cast<const unsigned char *>(data.data()), grouped / 4, 0,
+         reinterpret_cast<unsigned int *>(ret.data()));
+  return ret;
+}
+bool PostingList::write(Vectors::Vector &vector, const std::vector<int> &values) {
+  if (values.size() <= kMaxRaw) {
+    return vector.update(std::vector<int>(values));
+  }
+  auto size = static_cast<unsigned>(values.size());
+  unsigned grouped = size & ~3u;
+  std::vector<int> data((grouped / 4 * kMaxGroupSize + sizeof(int) + sizeof(int) - 1) / sizeof(int));
+  unsigned bytes = encode(reinterpret_cast<const unsigned int *>(values.data()), grouped, 0,
+                          reinterpret_cast<unsigned char *>(data.data()));
+  data.resize((bytes + sizeof(int) - 1) / sizeof(int));
+  data.insert(data.end(), values.begin() + grouped, values.end());
+  data.insert(data.end(), {values[grouped - 1], static_cast<int>(bytes), -static_cast<int>(size)});
+  return vector.update(std::move(data));
+}
+bool PostingList::rewrite(Vectors::Vector &vector, const std::vector<int> &data, unsigned int length,
+                          const std::vector<int> &values, unsigned int index) {
+  // the groups before the one of the value are kept, find where that group begins
+  unsigned group = index / 4, offset = 0;
+  const auto *bytes = reinterpret_cast<const unsigned char *>(data.data());
+  for (unsigned i = 0; i < group; ++i) {
+    unsigned char control = bytes[offset];
+    offset += 5 + (control & 3) + (control >> 2 & 3) + (control >> 4 & 3) + (control >> 6);
+  }
+  unsigned begin = offset / sizeof(int), partial = offset % sizeof(int);
+  auto size = static_cast<unsigned>(values.size());
+  unsigned grouped = size & ~3u;
+  std::vector<int> tail((partial + (grouped - group * 4) / 4 * kMaxGroupSize + sizeof(int) + sizeof(int) - 1) / sizeof(int));
+  if (partial) memcpy(tail.data(), bytes + begin * sizeof(int), partial);
+  unsigned added = encode(reinterpret_cast<const unsigned int *>(values.data()) + group * 4, grouped - group * 4,
+                          group ? values[group * 4 - 1] : 0, reinterpret_cast<unsigned char *>(tail.data()) + partial);
+  tail.resize((partial + added + sizeof(int) - 1) / sizeof(int));
+  tail.insert(tail.end(), values.begin() + grouped, values.end());
+  tail.insert(tail.end(), {values[grouped - 1], static_cast<int>(offset + added), -static_cast<int>(size)});
+  unsigned overlap = std::min<unsigned>(tail.size(), length - begin);
+  vector.setData(begin, std::vector<int>(tail.begin(), tail.begin() + overlap));
+  if (begin + tail.size() < length) {
+    vector.truncate(begin + tail.size());
+    return false;
+  }
+  bool ret = false;
+  for (unsigned i = overlap; i < tail.size(); ++i) {
+    ret |= vector.push_back(tail[i]);
+  }
+  return ret;
+}
+bool PostingList::insert(Vectors::Vector &vector, int value) {
+  unsigned length = vector.size();
+  if (!length) {
+    return vector.push_back(value);
+  }
+  // the trailer, the values after the groups and the partial integer of the groups
+  std::vector<int> rest = vector.getData(length - std::min(length, kTrailerSize + 4), length);
+  int last = rest.back();
+  if (last < 0) { // compressed
+    unsigned size = -last;
+    int base = rest[rest.size() - 3];
+    unsigned bytes = rest[rest.size() - 2];
+    last = size % 4 ? rest[rest.size() - kTrailerSize - 1] : base;
+    if (value > last) {
+      unsigned end = length - kTrailerSize;
+      if (size % 4 != 3) { // the trailer moves one integer further
+        vector.setData(end, {value, base, static_cast<int>(bytes)});
+        return vector.push_back(-static_cast<int>(size + 1));
+      }
+      // pack the partial integer of the groups, the values after the groups and the new value into a group
+      const int *ungrouped = rest.data() + rest.size() - kTrailerSize - 3;
+      unsigned values[4] = {static_cast<unsigned>(ungrouped[0]), static_cast<unsigned>(ungrouped[1]),
+                            static_cast<unsigned>(ungrouped[2]), static_cast<unsigned>(value)};
+      int packed[(sizeof(int) + kMaxGroupSize + sizeof(int) + sizeof(int) - 1) / sizeof(int)] = {};
+      unsigned partial = bytes % sizeof(int);
+      if (partial) packed[0] = ungrouped[-1];
+      unsigned added = encode(values, 4, base, reinterpret_cast<unsigned char *>(packed) + partial);
+      vector.truncate(end - 3 - (partial != 0));
+      bool ret = false;
+      for (unsigned i = 0; i < (partial + added + sizeof(int) - 1) / sizeof(int); ++i) {
+        ret |= vector.push_back(packed[i]);
+      }
+      ret |= vector.push_back(value);
+      ret |= vector.push_back(static_cast<int>(bytes + added));
+      ret |= vector.push_back(-static_cast<int>(size + 1));
+      return ret;
+    }
+    if (value == last) {
+      return false;
+    }
+  } else {
+    if (value > last && length < kMaxRaw) {
+      return vector.push_back(value);
+    }
+    if (value == last) {
+      return false;
+    }
+  }
+  std::vector<int> data = vector.getData();
+  if (rest.back() >= 0) {
+    auto it = std::lower_bound(data.begin(), data.end(), value);
+    if (it != data.end() && *it == value) {
+      return false;
+    }
+    data.insert(it, value);
+    return write(vector, data);
+  }
+  std::vector<int> values = unpack(data);
+  auto it = std::lower_bound(values.begin(), values.end(), value);
+  if (it != values.end() && *it == value) {
+    return false;
+  }
+  unsigned index = it - values.begin();
+  values.insert(it, value);
+  return rewrite(vector, data, length, values, index);
+}
+bool PostingList::erase(Vectors::Vector &vector, int value) {
+  unsigned length = vector.size();
+  if (!length) {
+    return false;
+  }
+  std::vector<int> rest = vector.getData(length - std::min(length, kTrailerSize + 1), length);
+  int last = rest.back();
+  if (last < 0) { // compressed
+    unsigned size = -last;
+    if (size % 4 && rest[0] == value) { // the greatest value is after the groups, the trailer moves one integer back
+      vector.setData(length - kTrailerSize - 1, {rest[1], rest[2], -static_cast<int>(size - 1)});
+      vector.truncate(length - 1);
+      return false;
+    }
+    if (value > (size % 4 ? rest[0] : rest[1])) {
+      return false;
+    }
+  } else {
+    if (value == last) {
+      if (length == 1) return vector.del();
+      vector.truncate(length - 1);
+      return false;
+    }
+    if (value > last) {
+      return false;
+    }
+  }
+  std::vector<int> data = vector.getData();
+  if (last >= 0) {
+    auto it = std::lower_bound(data.begin(), data.end(), value);
+    if (it == data.end() || *it != value) {
+      return false;
+    }
+    data.erase(it);
+    return vector.update(std::move(data));
+  }
+  std::vector<int> values = unpack(data);
+  auto it = std::lower_bound(values.begin(), values.end(), value);
+  if (it == values.end() || *it != value) {
+    return false;
+  }
+  unsigned index = it - values.begin();
+  values.erase(it);
+  auto size = static_cast<unsigned>(values.size());
+  if (size <= kMaxRaw) {
+    return write(vector, values);
+  }
+  return rewrite(vector, data, length, values, index);
+}
 } // namespace external_memory
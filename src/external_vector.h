@@ -5,52 +5,83 @@
 #ifndef BOOKSTORE_SRC_EXTERNAL_MEMORY_CPP_EXTERNAL_VECTORS_H_
 #define BOOKSTORE_SRC_EXTERNAL_MEMORY_CPP_EXTERNAL_VECTORS_H_
 
-#include <fstream>
+#include <bit>
 #include <vector>
 #include <string>
-#include <set>
 #include "external_memory.h"
 
 namespace external_memory {
 /**
  * @brief A class to manage a set of vectors.
- * @details A vector is a sequence of non-zero integers.
+ * @details A vector is a sequence of integers.
  * @details A vector is identified by its position in the file.
+ * @details The length of a vector is stored explicitly: in the integer before the elements for a small vector, and in
+ * the info of the first page for a large vector. Appending an element writes the element and the length only, unless
+ * the vector has to be moved.
  * @details When making changes to a vector, its position may change. If so, the return value of the modifying function will be true.
  * @details Internally, there are two types of vectors: small vectors and large vectors.
- * @details - Small vectors, whose capacity is strictly less than kIntegerPerPage, and is a power of 2, share a page with other small vectors of the same capacity.
+ * @details - Small vectors, whose space (the length and the elements) is strictly less than kIntegerPerPage, and is a power of 2, share a page with other small vectors of the same space.
  * @details - Large vectors, whose capacity is greater than or equal to kIntegerPerPage, have their own page(s).
- * @details The info file stores the information of all pages. It is cached in memory.
+ * @details The pages of a large vector are allocated in extents, i.e. runs of consecutive pages. The sizes of the extents
+ * are 1, 1, 2, 4, ... pages, up to kMaxExtentPages, so a large vector has a number of extents logarithmic in its size
+ * and is read with a few sequential reads. The extents are linked through the info of their first pages.
+ * @details The info file stores the information of all pages. It is cached in memory, each block being read when it is first used.
+ * @details The pages of small vectors with free space, and the free extents, are kept in lists per size, linked through the
+ * info of the pages. The heads of the lists are in the info page of the data file, so opening the vectors reads no
+ * page info at all.
  *
  * @attention The position of a vector is not stored in the file. It is the user's responsibility to keep track of the position of a vector.
  * @attention The position of a vector may change after modifying it.
- * @attention Vector can only store non-zero integers. Storing zero is undefined behavior.
  *
- * @note Caching mechanism : If the vector is stored in a single page, the page is cached in memory. Otherwise, the vector is not cached.
+ * @note Caching mechanism : The data pages are cached by the buffer pool of `Pages`. Pages of a vector stored in a single page are fetched into the pool when the vector is got.
  * @note When a vector is created, it is empty.
- * @note If the capacity of a vector is >= kIntegerPerPage, the vector will no longer change its position, because new data will be stored in a new page.
+ * @note Once a vector is large, it will no longer change its position, because new data will be stored in a new extent.
+ * @note A discarded extent of several pages is kept whole, and reused by the next extent of the same size. Other
+ * extents of several pages are allocated at the end of the data file.
+ * @note The layout is versioned in the info page of the data file, and vectors of another version cannot be opened.
  */
 class Vectors {
  private:
   const std::string file_name_; // file_name_ + "_info" and file_name_ + "_data"
-  static constexpr unsigned int kInfoPerPage = 3; // number of information integers per page
+  static constexpr unsigned int kInfoPerPage = 5; // number of information integers per page
   static constexpr unsigned int
       kCapacityLogMax = __builtin_ctz(kIntegerPerPage / 2); // log2 of the maximum capacity of a small vector
   Array info_; // the info file, storing the information of all pages, cached in memory
   Pages data_; // the data file, storing all vectors
-  std::set<int> free_pages_of_capacity_[kCapacityLogMax + 1]; // free pages of capacity 2^i, only for small vectors
+  int &layout_ = data_.getInfo(1); // the version of the layout of the vectors
+  static constexpr int kLayoutVersion = 1; // vectors ended by zeros, without a length, and 3 integers of info per page are version 0
+  static constexpr unsigned int kMinSlots = 2; // the smallest space of a vector, the length and an element
+  static constexpr unsigned int kMaxExtentPages = 64; // the maximum number of pages of an extent, a power of 2
+  static constexpr unsigned int kMaxExtentLog = __builtin_ctz(kMaxExtentPages);
+  static constexpr unsigned int kFreeListsInfo = 2; // the index in the info page of the data file of the first list head
+  /**
+   * @brief Get the head of the list of pages of capacity 2^capacity_log with free space, only for small vectors.
+   * @return A reference to the head in the info page of the data file, 0 if the list is empty.
+   */
+  [[nodiscard]] int &freePages(unsigned int capacity_log) { return data_.getInfo(kFreeListsInfo + capacity_log); }
+  /**
+   * @brief Get the head of the list of free extents of 2^extent_log pages, for extent_log > 0.
+   * @return A reference to the head in the info page of the data file, 0 if the list is empty.
+   */
+  [[nodiscard]] int &freeExtents(unsigned int extent_log) {
+    return data_.getInfo(kFreeListsInfo + kCapacityLogMax + 1 + extent_log);
+  }
   /**
    * @brief The information of a page.
    */
   enum class kPageInfo : unsigned int {
     kCapacity =
-    0, // capacity of the page. Specially, 0 means the page is not used, -1 means the page is used for large vectors but is not the first page of the vector
+    0, // capacity of the page. Specially, 0 means the page is not used, -1 means the page is used for large vectors but is not the first page of the vector, kFreeExtent means the page is the first page of a free extent
     kFreeHead = 1, // for small vectors, the head of the free space in the page.
     kUnoccupiedBeg =
     2, // for small vectors, the beginning of the known unoccupied space at the end of the page. May not be the actual beginning of the unoccupied space.
-    kNextPage = 1, // for large vectors, the next page of the vector.
-    kLastPage = 2 // for large vectors, the last page of the vector. Only valid for the first page of the vector.
+    kNextPage = 1, // for large vectors, the first page of the next extent. Only valid for the first page of an extent.
+    kLastPage = 2, // for large vectors, the first page of the last extent. Only valid for the first page of the vector.
+    kLength = 3, // for large vectors, the number of elements of the vector. Only valid for the first page of the vector.
+    kNextFree = 3, // for small vectors, the next page of the same capacity with free space. For free extents, the next free extent of the same size.
+    kPrevFree = 4 // for small vectors, the previous page of the same capacity with free space.
   };
+  static constexpr int kFreeExtent = -2; // the capacity of the first page of a free extent
   /**
    * @brief Get the information of a page.
    *
@@ -118,12 +149,54 @@ class Vectors {
    * @note The info of the page is cleared.
    */
   [[nodiscard]] unsigned int newPage();
+  /**
+   * @brief Allocate consecutive new pages.
+   * @param count The number of pages.
+   * @return unsigned int The index of the first page, 1-based.
+   * @note A free extent of `count` pages is reused if there is one.
+   * @note The info of the pages is cleared. The pages are not cleared unless `count` is 1.
+   */
+  [[nodiscard]] unsigned int newPages(unsigned int count);
+  /**
+   * @brief Delete consecutive pages allocated by `newPages`.
+   * @param n The index of the first page, 1-based.
+   * @param count The number of pages.
+   */
+  void deletePages(unsigned int n, unsigned int count);
+  /**
+   * @brief Get the number of pages of an extent of a large vector.
+   * @param k The index of the extent, 0-based.
+   */
+  [[nodiscard]] static unsigned int extentPages(unsigned int k);
+  /**
+   * @brief Get the index of the first page of an extent within a large vector.
+   * @param k The index of the extent, 0-based.
+   */
+  [[nodiscard]] static unsigned int extentBegin(unsigned int k);
+  /**
+   * @brief Get the extent holding a page of a large vector.
+   * @param n The index of the page within the vector, 0-based.
+   * @return The index of the extent, 0-based.
+   */
+  [[nodiscard]] static unsigned int extentOf(unsigned int n);
   /**
    * @brief Delete a page.
    * @param n The index of the page, 1-based.
    * @note The info of the page is cleared, making it a free page.
    */
   void deletePage(unsigned int n);
+  /**
+   * @brief Add a page to the front of the list of pages of its capacity with free space.
+   * @param n The index of the page, 1-based, which must not be in the list.
+   * @param capacity_log log2 of the capacity of the page.
+   */
+  void linkFreePage(unsigned int n, unsigned int capacity_log);
+  /**
+   * @brief Remove a page from the list of pages of its capacity with free space.
+   * @param n The index of the page, 1-based, which must be in the list.
+   * @param capacity_log log2 of the capacity of the page.
+   */
+  void unlinkFreePage(unsigned int n, unsigned int capacity_log);
   /**
    * @brief Clear the space for a vector.
    * @param capacity The capacity of the vector, must be a power of 2 and <= kIntegerPerPage.
@@ -135,9 +208,11 @@ class Vectors {
  public:
   /**
    * @brief Construct a new Vectors object.
+   * @param name The name (and path) of the files.
+   * @param frame_count The number of data pages cached in memory.
    */
-  explicit Vectors(std::string name = "vectors")
-      : file_name_(std::move(name)), info_(file_name_ + "_info"), data_(file_name_ + "_data") {}
+  explicit Vectors(std::string name = "vectors", unsigned int frame_count = Pages::kDefaultFrameCount)
+      : file_name_(std::move(name)), info_(file_name_ + "_info"), data_(file_name_ + "_data", frame_count) {}
   Vectors(const Vectors &) = delete;
   Vectors &operator=(const Vectors &) = delete;
   /**
@@ -161,6 +236,15 @@ class Vectors {
    * @attention `initialize` must not be called twice.
    */
   void initialize(bool reset = false);
+  /**
+   * @brief Write the cached info and pages back to the files.
+   * @details The cache stays valid.
+   */
+  void checkpoint();
+  /**
+   * @brief Write the files to the disk, after `checkpoint`.
+   */
+  void sync();
   /**
    * @brief a class to manage a vector.
    *
@@ -180,15 +264,37 @@ class Vectors {
     explicit Vector(Vectors &vectors, unsigned int pos = 0) :
         vectors_(vectors), pos_(pos) { updatePos(pos); }
     /**
-     * @brief Only for large vectors. Append a new page to the vector.
-     * @return the index of the new page, 1-based.
+     * @brief Get the number of integers of the space of the vector, including the length of a small vector.
      */
-    unsigned int appendPage();
+    [[nodiscard]] unsigned int slots() const;
     /**
-     * @brief Only for large vectors. Discard all pages after the given page.
-     * @param last_page The index of the last page to be kept, 1-based.
+     * @brief Only for large vectors. Append a new extent to the vector.
+     * @return the index of the first page of the new extent, 1-based.
      */
-    void discardAfter(unsigned int last_page);
+    unsigned int appendExtent();
+    /**
+     * @brief Only for large vectors. Discard all extents after the given extent.
+     * @param last_extent The index of the last extent to be kept, 0-based.
+     */
+    void discardAfter(unsigned int last_extent);
+    /**
+     * @brief Only for large vectors. Get the first page of an extent.
+     * @param k The index of the extent, which must be less than the number of extents.
+     * @return the index of the page, 1-based.
+     */
+    [[nodiscard]] unsigned int extentAt(unsigned int k) const;
+    /**
+     * @brief Only for large vectors. Get the page holding an element.
+     * @param index The index of the element, which must be less than the capacity.
+     * @return the index of the page, 1-based.
+     */
+    [[nodiscard]] unsigned int pageOf(unsigned int index) const;
+    /**
+     * @brief Only for large vectors. Call `function(page, offset, len)` for each page holding the elements in [begin, end), in order.
+     * @details `offset` is the offset of the first of the `len` elements in the page.
+     */
+    template<class Function>
+    void forEachPage(unsigned int begin, unsigned int end, Function function);
     /**
      * @brief Update the position of the vector.
      * @param new_pos The new position.
@@ -208,11 +314,23 @@ class Vectors {
      * @attention The returned vector is read from the cache or even the file every time this function is called.
      */
     [[nodiscard]] std::vector<int> getData();
+    /**
+     * @brief Get a range of the elements of the vector.
+     * @param begin The index of the first element.
+     * @param end The index after the last element.
+     * @return The elements.
+     * @attention No bound checking is performed.
+     */
+    [[nodiscard]] std::vector<int> getData(unsigned int begin, unsigned int end);
     /**
      * @brief Get the capacity of the vector.
-     * @return The capacity of the vector.
+     * @return The number of elements that the vector can hold without allocating space.
      */
     [[nodiscard]] unsigned int capacity() const;
+    /**
+     * @brief Get the number of elements of the vector.
+     */
+    [[nodiscard]] unsigned int size() const;
     /**
      * @brief Append a new element to the vector.
      * @param value The value to be appended.
@@ -220,6 +338,21 @@ class Vectors {
      * @attention The change is committed to cache or file immediately.
      */
     bool push_back(int value);
+    /**
+     * @brief Modify a range of the elements of the vector in place.
+     * @param begin The index of the first element.
+     * @param values The new values.
+     * @attention No bound checking is performed.
+     * @attention The change is committed to cache or file immediately.
+     */
+    void setData(unsigned int begin, const std::vector<int> &values);
+    /**
+     * @brief Drop the elements after the first `size` ones.
+     * @details The vector is not moved. A large vector returns the pages after its last element.
+     * @param size The new number of elements, which must not be greater than the current one.
+     * @attention The change is committed to cache or file immediately.
+     */
+    void truncate(unsigned int size);
     /**
      * @brief Modify the vector.
      * @param data The new data of the vector.
@@ -246,5 +379,71 @@ class Vectors {
    */
   [[nodiscard]] Vector newVector();
 };
+/**
+ * @brief Sorted sets of non-negative integers (posting lists), stored in `Vectors` and compressed with group varint.
+ * @details A list of at most `kMaxRaw` values is stored as is, in ascending order.
+ * @details A longer list is stored as the groups packed into integers, followed by the last `size % 4` values as is,
+ * followed by a trailer of `kTrailerSize` integers: the last value of the groups, the number of bytes of the groups
+ * and the number of values negated. The trailer comes last so that appending to a list touches its last page only.
+ * @details A group encodes 4 values as the differences to their predecessors: a control byte, holding the length minus
+ * 1 of each difference in 2 bits, and then the differences in 1 to 4 little-endian bytes each.
+ * @details Groups are decoded with SSSE3 when the processor supports it.
+ * @details Inserting a value greater than all values of a list writes the value and the trailer only,
+ * and every 4th such value packs the values after the groups into a new group.
+ * @see https://static.googleusercontent.com/media/research.google.com/en//people/jeff/WSDM09-keynote.pdf
+ */
+class PostingList {
+ private:
+  static constexpr unsigned int kMaxRaw = 15; // the maximum number of values of a list stored as is
+  static constexpr unsigned int kTrailerSize = 3; // the size of the trailer of a compressed list
+  static constexpr unsigned int kMaxGroupSize = 17; // the maximum number of bytes of a group
+  static constexpr unsigned int kPadding = 16; // the number of bytes readable after the groups when decoding
+  static std::vector<int> unpack(std::vector<int> &data); // the values of a list from its data, which is padded for decoding
+  static bool rewrite(Vectors::Vector &vector, const std::vector<int> &data, unsigned int length,
+                      const std::vector<int> &values, unsigned int index); // encode and write the groups of a compressed list from the one of the value at index on, the groups before it being those in data
+ public:
+  /**
+   * @brief Encode groups of values.
+   * @param values The values, in ascending order.
+   * @param count The number of values, a multiple of 4.
+   * @param base The value before the first one.
+   * @param dest The destination, with room for `count / 4 * kMaxGroupSize + sizeof(int)` bytes: each difference is stored as 4 bytes, of which the unused ones are overwritten or left after the groups.
+   * @return The number of bytes written.
+   */
+  static unsigned int encode(const unsigned int *values, unsigned int count, unsigned int base, unsigned char *dest);
+  /**
+   * @brief Decode groups of values.
+   * @param src The groups.
+   * @param groups The number of groups.
+   * @param base The value before the first one.
+   * @param dest The destination, with room for `groups * 4` values.
+   * @attention `kPadding` bytes after the groups must be readable.
+   */
+  static void decode(const unsigned char *src, unsigned int groups, unsigned int base, unsigned int *dest);
+  /**
+   * @brief Read a list.
+   * @return The values, in ascending order.
+   */
+  [[nodiscard]] static std::vector<int> read(Vectors::Vector &vector);
+  /**
+   * @brief Replace the values of a list.
+   * @param values The values, in ascending order and without duplicates. The list is deleted if they are empty.
+   * @return Whether the position of the vector has changed.
+   */
+  static bool write(Vectors::Vector &vector, const std::vector<int> &values);
+  /**
+   * @brief Insert a value into a list, if it is not in it.
+   * @details Otherwise a compressed list is read and decoded as a whole, but only the groups from the one that gets the value on are encoded and written again.
+   * @return Whether the position of the vector has changed.
+   */
+  static bool insert(Vectors::Vector &vector, int value);
+  /**
+   * @brief Erase a value from a list, if it is in it.
+   * @details Erasing the greatest value of a list writes the tail of the list only, unless the value is grouped.
+   * @details Otherwise a compressed list is read and decoded as a whole, but only the groups from the one that held the value on are encoded and written again.
+   * @return Whether the position of the vector has changed.
+   */
+  static bool erase(Vectors::Vector &vector, int value);
+};
 } // namespace external_memory
 #endif //BOOKSTORE_SRC_EXTERNAL_MEMORY_CPP_EXTERNAL_VECTORS_H_
@@ -2,7 +2,205 @@
 // Created by zj on 11/30/2023.
 //
 
+#include <fcntl.h>
+#include <unistd.h>
 #include "log.h"
+
+namespace {
+constexpr unsigned int kRecordHeaderSize = sizeof(unsigned int) + sizeof(kRecordType) + sizeof(unsigned int); // size, type and id
+constexpr unsigned int kChecksumSize = sizeof(unsigned int);
+unsigned int checksum(const char *data, size_t size) { // FNV-1a
+  unsigned int hash = 2166136261u;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ static_cast<unsigned char>(data[i])) * 16777619u;
+  }
+  return hash;
+}
+/// Parse the record at `pos`. Return the size of the record, or 0 if the record is incomplete or corrupted.
+size_t parseRecord(const std::string &file, size_t pos, WriteAheadLog::Record &record) {
+  if (file.size() - pos < kRecordHeaderSize + kChecksumSize) return 0;
+  const char *header = file.data() + pos;
+  memcpy(&record.size, header, sizeof(unsigned int));
+  memcpy(&record.type, header + sizeof(unsigned int), sizeof(kRecordType));
+  memcpy(&record.id, header + sizeof(unsigned int) + sizeof(kRecordType), sizeof(unsigned int));
+  size_t total = kRecordHeaderSize + record.size + kChecksumSize;
+  if (file.size() - pos < total) return 0;
+  unsigned int sum;
+  memcpy(&sum, header + kRecordHeaderSize + record.size, kChecksumSize);
+  if (sum != checksum(header, kRecordHeaderSize + record.size)) return 0;
+  record.data = header + kRecordHeaderSize;
+  return total;
+}
+std::string readFile(int fd) {
+  std::string content;
+  char buffer[1 << 16];
+  ssize_t n;
+  lseek(fd, 0, SEEK_SET);
+  while ((n = ::read(fd, buffer, sizeof(buffer))) > 0) content.append(buffer, n);
+  return content;
+}
+} // namespace
+
+WriteAheadLog::~WriteAheadLog() {
+  stop();
+  if (fd_ < 0) return;
+  write();
+  ::close(fd_);
+}
+void WriteAheadLog::stop() {
+  if (!syncer_.joinable()) return;
+  {
+    std::lock_guard lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_one();
+  syncer_.join();
+}
+void WriteAheadLog::close() {
+  stop();
+  if (fd_ < 0) return;
+  truncate();
+  ::close(fd_);
+  fd_ = -1;
+}
+void WriteAheadLog::initialize(bool reset) {
+  fd_ = open(file_path_.c_str(), O_RDWR | O_CREAT | O_APPEND | (reset ? O_TRUNC : 0), 0644);
+  if (fd_ < 0) {
+    throw std::runtime_error("Cannot open file " + file_path_);
+  }
+  std::string file = readFile(fd_);
+  size_t pos = 0, valid_end = 0;
+  Record record{};
+  while (size_t size = parseRecord(file, pos, record)) {
+    pos += size;
+    if (record.type == kRecordType::kCommit) valid_end = pos;
+  }
+  if (valid_end < file.size()) {
+    if (ftruncate(fd_, static_cast<off_t>(valid_end)) != 0) {
+      throw std::runtime_error("Cannot truncate file " + file_path_);
+    }
+  }
+  clean_ = valid_end == 0;
+  begin();
+  if (policy_ == kSyncPolicy::kInterval) syncer_ = std::thread(&WriteAheadLog::run, this);
+}
+void WriteAheadLog::begin() {
+  append(kRecordType::kCommit, 0, nullptr, 0);
+  committed_ = buffer_.size();
+  sync();
+}
+void WriteAheadLog::replay(const std::function<void(const Record &)> &apply) {
+  std::string file = readFile(fd_);
+  std::vector<Record> group;
+  size_t pos = 0;
+  Record record{};
+  while (size_t size = parseRecord(file, pos, record)) {
+    pos += size;
+    if (record.type == kRecordType::kCommit) {
+      for (auto &item : group) apply(item);
+      group.clear();
+      release();
+    } else {
+      group.push_back(record);
+    }
+  }
+}
+void WriteAheadLog::append(kRecordType type, unsigned int id, const char *data, unsigned int size) {
+  size_t begin = buffer_.size();
+  buffer_.append(reinterpret_cast<const char *>(&size), sizeof(unsigned int));
+  buffer_.append(reinterpret_cast<const char *>(&type), sizeof(kRecordType));
+  buffer_.append(reinterpret_cast<const char *>(&id), sizeof(unsigned int));
+  buffer_.append(data, size);
+  unsigned int sum = checksum(buffer_.data() + begin, buffer_.size() - begin);
+  buffer_.append(reinterpret_cast<const char *>(&sum), kChecksumSize);
+}
+void WriteAheadLog::log(kRecordType type, unsigned int id, const char *data, unsigned int size) {
+  append(type, id, data, size);
+}
+void WriteAheadLog::commit() {
+  if (buffer_.size() != committed_) {
+    append(kRecordType::kCommit, 0, nullptr, 0);
+    committed_ = buffer_.size();
+  }
+  if (policy_ == kSyncPolicy::kEveryCommand) {
+    std::unique_lock lock(mutex_);
+    if (committed_ || !synced_) {
+      lock.unlock();
+      sync();
+    }
+  } else {
+    write();
+  }
+  release();
+}
+void WriteAheadLog::release() {
+  for (auto &callback : on_commit_) callback();
+}
+void WriteAheadLog::write() {
+  size_t written = 0;
+  while (written < committed_) {
+    ssize_t n = ::write(fd_, buffer_.data() + written, committed_ - written);
+    if (n < 0) throw std::runtime_error("Cannot write file " + file_path_);
+    written += n;
+  }
+  buffer_.erase(0, committed_);
+  if (committed_) {
+    {
+      std::lock_guard lock(mutex_);
+      synced_ = false;
+    }
+    wake_.notify_one();
+  }
+  committed_ = 0;
+}
+void WriteAheadLog::run() {
+  std::unique_lock lock(mutex_);
+  while (!stop_) {
+    if (synced_) {
+      wake_.wait(lock);
+      continue;
+    }
+    auto deadline = last_sync_ + sync_interval_;
+    if (std::chrono::steady_clock::now() < deadline) {
+      wake_.wait_until(lock, deadline);
+      continue;
+    }
+    synced_ = true; // records written during the fdatasync below clear it again
+    last_sync_ = std::chrono::steady_clock::now();
+    lock.unlock();
+    fdatasync(fd_);
+    lock.lock();
+  }
+}
+void WriteAheadLog::sync() {
+  write();
+  fdatasync(fd_);
+  std::lock_guard lock(mutex_);
+  synced_ = true;
+  last_sync_ = std::chrono::steady_clock::now();
+}
+void WriteAheadLog::force() {
+  if (policy_ == kSyncPolicy::kOnExit) return;
+  {
+    std::lock_guard lock(mutex_);
+    if (synced_) return;
+  }
+  sync();
+}
+void WriteAheadLog::checkpoint() {
+  truncate();
+  begin();
+}
+void WriteAheadLog::truncate() {
+  write();
+  if (ftruncate(fd_, 0) != 0) {
+    throw std::runtime_error("Cannot truncate file " + file_path_);
+  }
+  fdatasync(fd_);
+  std::lock_guard lock(mutex_);
+  synced_ = true;
+  last_sync_ = std::chrono::steady_clock::now();
+}
 FinanceRecord &FinanceRecord::log(long long int money) {
   if (money > 0) income_sum_ += money;
   else expenditure_sum_ += -money;
@@ -13,16 +211,19 @@ FinanceRecord FinanceRecord::operator-(const FinanceRecord &rhs) const {
 }
 void FinanceLog::initialize(bool reset) {
   log_.initialize(reset);
+  wal_.protect(log_);
   if (reset) {
     current_sum_ = {0, 0};
-    log_.insert(current_sum_);
-  } else {
+    wal_.log(kRecordType::kFinance, log_.insert(current_sum_), current_sum_);
+  } else if (log_.size()) {
     current_sum_ = log_.get(log_.size());
+  } else {
+    current_sum_ = {0, 0}; // the last run crashed before writing anything, the records are restored from the write-ahead log
   }
 }
 void FinanceLog::log(long long int money) {
   current_sum_.log(money);
-  log_.insert(current_sum_);
+  wal_.log(kRecordType::kFinance, log_.insert(current_sum_), current_sum_);
 }
 FinanceRecord FinanceLog::sum(unsigned int count) {
   if (count > log_.size() - 1) return {static_cast<unsigned long long>(-1), static_cast<unsigned long long>(-1)};
@@ -32,6 +233,14 @@ FinanceRecord FinanceLog::sum(unsigned int count) {
 FinanceRecord FinanceLog::sum() {
   return current_sum_;
 }
+void FinanceLog::restore(unsigned int n, const FinanceRecord &record) {
+  log_.extend(n);
+  log_.set(n, record);
+  if (n == log_.size()) current_sum_ = record;
+}
+void FinanceLog::checkpoint() {
+  log_.flush();
+}
 void UserLog::initialize(bool reset) {
   if (reset) {
     log_.open(file_path_, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
@@ -5,6 +5,12 @@
 #ifndef BOOKSTORE_SRC_LOG_H_
 #define BOOKSTORE_SRC_LOG_H_
 
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <thread>
 #include "external_memory.h"
 
 enum class kExceptionType {
@@ -28,6 +34,132 @@ enum class kExceptionType {
 
 std::string exceptionTypeToString(kExceptionType exception_type);
 
+/// @brief The type of a record in the write-ahead log
+enum class kRecordType : unsigned char {
+  kCommit, // the end of a command, the records before it are applied atomically
+  kBook, // the new content of a book, keyed by the ID of the book
+  kUser, // the new content of a user, keyed by the position of the user in the user list
+  kUserErase, // the deletion of a user, keyed by the position of the user in the user list
+  kFinance // the new content of a finance record, keyed by its position in the finance log
+};
+
+/// @brief When the write-ahead log is synchronized to the disk
+enum class kSyncPolicy {
+  kEveryCommand, // after every mutating command
+  kInterval, // by a background thread, once the sync interval has elapsed since the last sync, even if no command follows
+  kOnExit // only at checkpoints, i.e. when the log is closed
+};
+
+/**
+ * @brief The write-ahead log
+ * @details The write-ahead log records the new content of every record that is written to the primary data (books, users and finance records).
+ * @details Records are buffered in memory. `commit` ends a command: the records of a command are replayed either all or none.
+ * @details `commit` writes the records of the command to the file with a single write, so a crash of the process loses no committed command.
+ * The sync policy only decides when the file is synchronized (fdatasync), i.e. which commands survive a crash of the system.
+ * Commands committed between two synchronizations form a group, which is synchronized at once.
+ * @details The lists of primary data are protected (see `protect`): the pages modified by a command are held in memory until the command commits (no-steal),
+ * so the files never hold part of a command. The log is synchronized before a page is written back, so the files never hold a change whose record is lost.
+ * If the files are memory mapped, the operating system writes the pages back at any time, so a crash may leave part of a command in them.
+ * @details `checkpoint` truncates the log while running, and `close` truncates and closes it on exit. Both require the caller to have written all caches back to the files and synchronized them.
+ * @details If the log is destroyed without `close`, the committed records are kept, and the next run recovers from them.
+ * @details The records are idempotent: replaying a record overwrites the record in the primary data. Indexes are not logged, they should be rebuilt from the primary data after replaying.
+ * @attention `initialize` must be called before using the log.
+ */
+class WriteAheadLog {
+ public:
+  /// @brief A record in the log
+  struct Record {
+    kRecordType type;
+    unsigned int id; // the key of the record
+    const char *data; // the new content
+    unsigned int size; // the size of the new content in bytes
+  };
+ private:
+  const std::string file_prefix_; // the prefix (including path) of the files of the database
+  const std::string file_path_; // the path of the log
+  int fd_ = -1; // the file descriptor of the log
+  kSyncPolicy policy_; // the sync policy
+  std::chrono::milliseconds sync_interval_; // the sync interval, only for kSyncPolicy::kInterval
+  std::chrono::steady_clock::time_point last_sync_; // the time of the last sync, guarded by mutex_
+  std::string buffer_; // records that are not written to the file yet
+  size_t committed_ = 0; // the size of the committed prefix of buffer_
+  bool synced_ = true; // whether all written records are synchronized, guarded by mutex_
+  bool clean_ = true; // whether the log was empty when it was initialized
+  std::thread syncer_; // the thread synchronizing the log, only for kSyncPolicy::kInterval
+  std::mutex mutex_; // guards the state shared with syncer_
+  std::condition_variable wake_; // wakes syncer_ up when records are written or when the log is destroyed
+  bool stop_ = false; // whether syncer_ should exit, guarded by mutex_
+  std::vector<std::function<void()>> on_commit_; // called once the records of a command are written, see `protect`
+  void append(kRecordType type, unsigned int id, const char *data, unsigned int size);
+  void write(); // write the committed records in the buffer to the file
+  void run(); // the body of syncer_: synchronize the written records once the sync interval has elapsed since the last sync
+  void stop(); // stop syncer_, if it is running
+  void release(); // call on_commit_
+  void begin(); // write and synchronize an empty command, so that the log is not empty until the next checkpoint
+  void truncate(); // write the committed records and truncate the log
+ public:
+  /// \brief Construct a new WriteAheadLog object
+  /// \param file_prefix The prefix (and path) of the files of the database. The log is stored in `file_prefix + "_wal.log"`
+  /// \param policy The sync policy
+  /// \param sync_interval The sync interval, only for kSyncPolicy::kInterval
+  explicit WriteAheadLog(std::string file_prefix = "bookstore",
+                         kSyncPolicy policy = kSyncPolicy::kInterval,
+                         std::chrono::milliseconds sync_interval = std::chrono::milliseconds(1000))
+      : file_prefix_(std::move(file_prefix)), file_path_(file_prefix_ + "_wal.log"), policy_(policy),
+        sync_interval_(sync_interval) {}
+  WriteAheadLog(const WriteAheadLog &) = delete;
+  WriteAheadLog &operator=(const WriteAheadLog &) = delete;
+  /// \brief Destroy the WriteAheadLog object
+  /// \details If the log has not been closed by `close`, the committed records are written but not truncated.
+  ~WriteAheadLog();
+  /// \brief Initialize the WriteAheadLog object
+  /// \param reset Whether to reset the log
+  /// \details An incomplete command at the end of the log, left by a crash, is discarded.
+  /// \details An empty command is written and synchronized immediately, so that the log is not empty until the next checkpoint, even if the run crashes before its first sync.
+  /// \attention This function must not be called twice.
+  void initialize(bool reset = false);
+  /// \brief Whether the log was empty when it was initialized. If not, the last run did not exit normally.
+  [[nodiscard]] bool empty() const { return clean_; }
+  /// \brief Whether the log has been initialized and not closed
+  [[nodiscard]] bool isOpen() const { return fd_ >= 0; }
+  /// \brief Replay all committed records, in order
+  /// \details The protected lists are released after each command, as if it had just committed.
+  void replay(const std::function<void(const Record &)> &apply);
+  /// \brief Log the new content of a record
+  void log(kRecordType type, unsigned int id, const char *data, unsigned int size);
+  /// \brief Log the new content of a record
+  template<external_memory::ListElement T>
+  void log(kRecordType type, unsigned int id, const T &value) {
+    char bytes[T::byte_size()];
+    value.toBytes(bytes);
+    log(type, id, bytes, T::byte_size());
+  }
+  /// \brief End a command, and write its records to the file
+  /// \details If nothing has been logged since the last commit, no record is appended, but the log is still synchronized if the sync policy requires so.
+  /// \details Under kSyncPolicy::kInterval, the records are synchronized later by a background thread.
+  void commit();
+  /// \brief Write and synchronize all committed records
+  void sync();
+  /// \brief Synchronize the written records before a data page is written back, unless the sync policy is kSyncPolicy::kOnExit
+  void force();
+  /// \brief Protect a list of primary data
+  /// \details The pages modified by a command are held until the command commits, and the log is forced before a page is written back.
+  template<external_memory::ListElement T, bool recover_space>
+  void protect(external_memory::List<T, recover_space> &list) {
+    list.holdChanges();
+    list.beforeWriteBack([this] { force(); });
+    on_commit_.emplace_back([&list] { list.release(); });
+  }
+  /// \brief Truncate the log, so that the log does not grow without bound
+  /// \attention All storage classes must have written their caches back to their files, and synchronized the files.
+  /// \attention Must be called between commands, i.e. right after `commit`.
+  void checkpoint();
+  /// \brief Truncate and close the log, marking a normal exit
+  /// \attention All storage classes must have written their caches back to their files, and synchronized the files.
+  /// \attention Must be called right after `commit`. The log must not be used afterwards.
+  void close();
+};
+
 /// @brief The finance record
 class FinanceRecord {
   unsigned long long int income_sum_ = 0; // in cents
@@ -63,9 +195,10 @@ class FinanceLog {
   const std::string file_path_;
   external_memory::List<FinanceRecord, false> log_;
   FinanceRecord current_sum_ = {0, 0};
+  WriteAheadLog &wal_; // the write-ahead log, shared with other systems
  public:
   /// \brief Construct a new FinanceLog object
-  explicit FinanceLog(std::string file_path = "finance") : file_path_(std::move(file_path)), log_(file_path_) {};
+  FinanceLog(std::string file_path, WriteAheadLog &wal) : file_path_(std::move(file_path)), log_(file_path_), wal_(wal) {};
   /// \brief Initialize the FinanceLog object
   /// \param reset Whether to reset the FinanceLog object
   /// \attention This function must be called before using any other functions.
@@ -83,6 +216,14 @@ class FinanceLog {
   FinanceRecord sum(unsigned int count); // if `count` is larger than the number of logs, return FinanceRecord(-1, -1)
   /// \brief Get the sum of all the logs
   FinanceRecord sum();
+  /// \brief Restore a finance record from the write-ahead log
+  /// \param n The position of the record in the finance log
+  /// \param record The record
+  void restore(unsigned int n, const FinanceRecord &record);
+  /// \brief Write all cached finance records back to the file
+  void checkpoint();
+  /// \brief Write the file to the disk, after `checkpoint`
+  void sync() { log_.sync(); }
 };
 
 class UserLog {
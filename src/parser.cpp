@@ -2,6 +2,7 @@
 // Created by zj on 12/9/2023.
 //
 
+#include <algorithm>
 #include <cmath>
 #include "parser.h"
 
@@ -6,10 +6,19 @@
 #define BOOKSTORE_SRC_MAIN_CPP_TEST_H_
 
 #include <cassert>
+#include <map>
+#include <random>
+#include <set>
+#include <unordered_map>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "bookstore.h"
 #include "external_hash_map.h"
 #include "external_vector.h"
 #include "external_memory.h"
+#include "log.h"
 #include <iostream>
+#include <chrono>
 using namespace std;
 class Test {
  public:
@@ -287,16 +296,7 @@ class Test {
     }
     void erase(const std::string &key, int value) {
       assert(value > 0);
-      auto vec = map_.findAll(key);
-      // erase the first occurrence
-      for (auto it = vec.begin(); it != vec.end(); ++it) {
-        if (*it == value) {
-          vec.erase(it);
-          map_.update(key, std::move(vec));
-          return;
-        }
-      }
-//      map_.insert(key, -value);
+      map_.erase(key, value);
     }
     static void regularize(std::vector<int> &values) {
       std::sort(values.begin(), values.end());
@@ -365,5 +365,328 @@ class Test {
     }
     return true;
   }
+
+  static void test_wal() {
+    std::cout << "--- Test Write-Ahead Log ---" << std::endl;
+    std::vector<std::pair<unsigned int, int>> expected; // the committed records, (id, data)
+    {
+      WriteAheadLog wal(path + "wal", kSyncPolicy::kOnExit);
+      wal.initialize(true);
+      for (int i = 0; i < 100; ++i) {
+        wal.log(kRecordType::kBook, i, reinterpret_cast<const char *>(&i), sizeof(int));
+        if (i % 10 == 9 && i < 90) wal.commit(); // the last command does not commit
+        if (i == 95) wal.force(); // as if a data page were written back in the middle of the command
+        if (i < 90) expected.emplace_back(i, i);
+      }
+      std::cout << "Crash with an uncommitted command" << std::endl; // the log is destroyed without `close`
+    }
+    auto replay = [](WriteAheadLog &wal) {
+      std::vector<std::pair<unsigned int, int>> records;
+      wal.replay([&records](const WriteAheadLog::Record &record) {
+        assert(record.type == kRecordType::kBook && record.size == sizeof(int));
+        int data;
+        memcpy(&data, record.data, sizeof(int));
+        records.emplace_back(record.id, data);
+      });
+      return records;
+    };
+    {
+      WriteAheadLog wal(path + "wal");
+      wal.initialize(false);
+      assert(!wal.empty());
+      assert(replay(wal) == expected);
+      wal.commit();
+      wal.close();
+    }
+    WriteAheadLog wal(path + "wal");
+    wal.initialize(false);
+    assert(wal.empty());
+    assert(replay(wal).empty());
+    wal.commit();
+    wal.close();
+  }
+  static void test_recovery(bool use_tablespace = false) {
+    std::cout << "--- Test Recovery ---" << std::endl;
+    std::cout << "Tablespace: " << use_tablespace << std::endl;
+    const std::string prefix = path + "recovery";
+    const unsigned int n = 3000;
+    auto book = [](unsigned int i) {
+      return Book("ISBN" + std::to_string(i), "title" + std::to_string(i % 11), "author" + std::to_string(i % 7),
+                  "keyword" + std::to_string(i % 5) + "|common", 100 + i, 0);
+    };
+    // the child process runs the commands and exits without destroying the store, like a crash
+    pid_t pid = fork();
+    if (pid == 0) {
+      BookStore store(prefix, kSyncPolicy::kInterval, std::chrono::milliseconds(1000), use_tablespace);
+      store.initialize(true);
+      assert(store.login("root", "sjtu") == kExceptionType::K_SUCCESS);
+      for (unsigned int i = 0; i < n; ++i) {
+        Book b = book(i);
+        assert(store.select(b.ISBN) == kExceptionType::K_SUCCESS);
+        b.ISBN.clear(); // the ISBN is not modified
+        assert(store.modify(std::move(b)) == kExceptionType::K_SUCCESS);
+        assert(store.import_(i % 3 + 1, i + 1) == kExceptionType::K_SUCCESS);
+        if (i % 7 == 0) { // modify again, so that the indexes erase the old keys
+          assert(store.modify(Book("", "title" + std::to_string(i % 13), "", "keyword" + std::to_string(i % 3), 100 + i))
+                     == kExceptionType::K_SUCCESS);
+        }
+        store.idle();
+        if (i == n / 2) store.checkpoint(); // the commands before are in the files, the ones after only in the log
+      }
+      _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    std::map<std::string, Book> expected;
+    unsigned long long expenditure = 0;
+    for (unsigned int i = 0; i < n; ++i) {
+      Book b = book(i);
+      b.quantity = i % 3 + 1;
+      if (i % 7 == 0) {
+        b.title = "title" + std::to_string(i % 13);
+        b.keywords = "keyword" + std::to_string(i % 3);
+      }
+      expected[b.ISBN] = b;
+      expenditure += i + 1;
+    }
+    BookStore store(prefix, kSyncPolicy::kInterval, std::chrono::milliseconds(1000), use_tablespace);
+    store.initialize(false); // replays the log
+    assert(store.login("root", "sjtu") == kExceptionType::K_SUCCESS);
+    auto finance = store.showFinance();
+    assert(finance.first == kExceptionType::K_SUCCESS);
+    assert(finance.second.expenditure() == expenditure && finance.second.income() == 0);
+    auto check = [&](const Book &params, auto &&match) {
+      auto result = store.search(params);
+      assert(result.first == kExceptionType::K_SUCCESS);
+      std::vector<std::string> found, wanted;
+      for (auto &b : result.second) found.push_back(b.ISBN);
+      for (auto &[ISBN, b] : expected) {
+        if (!match(b)) continue;
+        wanted.push_back(ISBN);
+        auto it = std::find(found.begin(), found.end(), ISBN);
+        assert(it != found.end());
+        const Book &got = result.second[it - found.begin()];
+        assert(got.title == b.title && got.author == b.author && got.keywords == b.keywords
+                   && got.price == b.price && got.quantity == b.quantity);
+      }
+      std::sort(found.begin(), found.end());
+      assert(found == wanted);
+    };
+    check(Book(), [](const Book &) { return true; });
+    for (int i = 0; i < 13; ++i) {
+      std::string title = "title" + std::to_string(i);
+      check(Book("", title), [&title](const Book &b) { return b.title == title; });
+    }
+    for (int i = 0; i < 7; ++i) {
+      std::string author = "author" + std::to_string(i);
+      check(Book("", "", author), [&author](const Book &b) { return b.author == author; });
+    }
+    for (std::string keyword : {"keyword0", "keyword1", "keyword2", "keyword3", "keyword4", "common"}) {
+      check(Book("", "", "", keyword), [&keyword](const Book &b) { return Book::hasKeyword(b.keywords, keyword); });
+    }
+    std::cout << "Recovered " << expected.size() << " books" << std::endl;
+  }
+  static void test_tablespace() {
+    std::cout << "--- Test Tablespace ---" << std::endl;
+    const std::string prefix = path + "tablespace";
+    test_recovery(true);
+    std::mt19937 rng(4);
+    std::map<unsigned int, Book> expected;
+    std::map<int, std::set<int>> expected_lists;
+    std::map<int, unsigned int> pos;
+    for (int round = 0; round < 3; ++round) {
+      external_memory::Tablespace tablespace(prefix);
+      tablespace.open(round == 0);
+      external_memory::List<Book> list(prefix + "_list", 4);
+      external_memory::Vectors vec(prefix + "_vectors", 4);
+      list.initialize(round == 0);
+      vec.initialize(round == 0);
+      for (int i = 0; i < 20000; ++i) {
+        unsigned int op = rng() % 4;
+        if (op == 0 || expected.empty()) {
+          Book b("ISBN" + std::to_string(rng()), "", "", "", rng() % 1000);
+          expected[list.insert(b)] = b;
+        } else if (op == 1) {
+          auto it = std::next(expected.begin(), static_cast<long>(rng() % expected.size()));
+          list.erase(it->first);
+          expected.erase(it);
+        } else {
+          int key = static_cast<int>(rng() % 8), value = static_cast<int>(rng() % 5000);
+          auto vec1 = vec.getVector(pos[key]);
+          external_memory::PostingList::insert(vec1, value);
+          expected_lists[key].insert(value);
+          pos[key] = vec1.getPos();
+        }
+      }
+      list.flush();
+      vec.checkpoint();
+      tablespace.sync();
+    }
+    assert(!std::filesystem::exists(prefix + "_list" + external_memory::kFileExtension)); // the files are segments
+    external_memory::Tablespace tablespace(prefix);
+    tablespace.open(false);
+    external_memory::List<Book> list(prefix + "_list", 4);
+    external_memory::Vectors vec(prefix + "_vectors", 4);
+    list.initialize(false);
+    vec.initialize(false);
+    for (auto &[id, b] : expected) {
+      Book got = list.get(id);
+      assert(got.ISBN == b.ISBN && got.price == b.price);
+    }
+    for (auto &[key, values] : expected_lists) {
+      auto vec1 = vec.getVector(pos[key]);
+      assert(external_memory::PostingList::read(vec1) == std::vector<int>(values.begin(), values.end()));
+    }
+    std::cout << expected.size() << " books and " << expected_lists.size() << " lists in the tablespace" << std::endl;
+  }
+  static void test_map(bool filter = false) {
+    std::cout << "--- Test Map ---" << std::endl;
+    std::cout << "Filter: " << filter << std::endl;
+    // the map grows by many doublings of the directory, and is reopened while the directory is migrated,
+    // then shrinks by merging buckets and halving the directory
+    std::mt19937 rng(3);
+    std::unordered_map<std::string, unsigned int> expected;
+    std::vector<std::string> keys;
+    for (int round = 0; round < 6; ++round) {
+      external_memory::Map<std::string> map(path + "map", 8, filter);
+      map.initialize(round == 0);
+      assert(map.size() == expected.size());
+      bool grow = round < 4;
+      for (int i = 0; i < (grow ? 40000 : 30000); ++i) {
+        unsigned int op = rng() % 4;
+        if (grow ? op < 2 : op == 0 && rng() % 4 == 0) {
+          std::string key = "key" + std::to_string(rng());
+          if (expected.contains(key)) continue;
+          unsigned int value = rng() | 1;
+          map.insert(key, value);
+          expected[key] = value;
+          keys.push_back(key);
+        } else if (!keys.empty() && op < 3) {
+          unsigned int i_key = rng() % keys.size();
+          map.erase(keys[i_key]);
+          expected.erase(keys[i_key]);
+          std::swap(keys[i_key], keys.back());
+          keys.pop_back();
+        } else {
+          if (keys.empty() || rng() % 2) {
+            assert(map.at("absent" + std::to_string(rng())) == 0);
+          } else {
+            const std::string &key = keys[rng() % keys.size()];
+            assert(map.at(key) == expected[key]);
+          }
+        }
+      }
+      if (round % 2) map.checkpoint(); // otherwise the destructor writes the map back
+      std::cout << "Round " << round << ": " << map.size() << " keys" << std::endl;
+    }
+    external_memory::Map<std::string> map(path + "map", 8, filter);
+    map.initialize(false);
+    assert(map.size() == expected.size());
+    for (auto &[key, value] : expected) assert(map.at(key) == value);
+  }
+  static void test_posting_list() {
+    std::cout << "--- Test Posting List ---" << std::endl;
+    // keys 0-9 hover around kMaxRaw values, keys 30-33 grow into large vectors of several pages
+    std::mt19937 rng(1);
+    std::map<int, std::set<int>> expected;
+    std::map<int, unsigned int> pos;
+    for (int round = 0; round < 3; ++round) {
+      external_memory::Vectors vec(path + "posting_list", 16);
+      vec.initialize(round == 0);
+      for (int i = 0; i < 100000; ++i) {
+        int key = static_cast<int>(rng() % 2 ? 30 + rng() % 4 : rng() % 30);
+        int value = static_cast<int>(rng() % (key < 10 ? 40 : key < 30 ? 3000 : 2000000));
+        auto vec1 = vec.getVector(pos[key]);
+        unsigned int op = rng() % 10;
+        if (op < 5) {
+          external_memory::PostingList::insert(vec1, value);
+          expected[key].insert(value);
+        } else if (op < 9) {
+          auto it = expected[key].lower_bound(value);
+          if (rng() % 2 && it != expected[key].end()) value = *it; // erase values that are in the list, too
+          external_memory::PostingList::erase(vec1, value);
+          expected[key].erase(value);
+        } else {
+          assert(external_memory::PostingList::read(vec1) == std::vector<int>(expected[key].begin(), expected[key].end()));
+        }
+        pos[key] = vec1.getPos();
+      }
+      vec.checkpoint();
+    }
+    external_memory::Vectors vec(path + "posting_list", 16);
+    vec.initialize(false);
+    for (auto &[key, values] : expected) {
+      auto vec1 = vec.getVector(pos[key]);
+      assert(external_memory::PostingList::read(vec1) == std::vector<int>(values.begin(), values.end()));
+      if (key % 10 == 0 || key == 33) std::cout << "Key " << key << ": " << values.size() << " values" << std::endl;
+    }
+  }
+  static void test_vector_free_list() {
+    std::cout << "--- Test Vector Free List ---" << std::endl;
+    std::mt19937 rng(2);
+    std::map<unsigned int, std::vector<int>> expected; // position -> data
+    std::vector<unsigned int> deleted_sizes;
+    auto create = [&](external_memory::Vectors &vec, unsigned int size) {
+      std::vector<int> data(size);
+      for (auto &x : data) x = static_cast<int>(rng());
+      auto vec1 = vec.newVector();
+      vec1.update(std::vector<int>(data));
+      expected[vec1.getPos()] = std::move(data);
+    };
+    {
+      external_memory::Vectors vec(path + "free_list");
+      vec.initialize(true);
+      for (int i = 0; i < 400; ++i) create(vec, rng() % 100 + 1);
+      for (int i = 0; i < 20; ++i) create(vec, rng() % 20000 + 2000); // large vectors, in extents
+      std::cout << "Delete every other vector" << std::endl;
+      bool odd = false;
+      for (auto it = expected.begin(); it != expected.end(); odd = !odd) {
+        if (!odd) {
+          ++it;
+          continue;
+        }
+        auto vec1 = vec.getVector(it->first);
+        deleted_sizes.push_back(vec1.size());
+        vec1.del();
+        it = expected.erase(it);
+      }
+      vec.checkpoint();
+    }
+    auto file_size = std::filesystem::file_size(path + "free_list_data" + external_memory::kFileExtension);
+    std::cout << "Reopen, and create vectors of the deleted sizes" << std::endl;
+    external_memory::Vectors vec(path + "free_list");
+    vec.initialize(false);
+    for (auto size : deleted_sizes) create(vec, size);
+    vec.checkpoint();
+    assert(std::filesystem::file_size(path + "free_list_data" + external_memory::kFileExtension) == file_size);
+    for (auto &[pos, data] : expected) {
+      auto vec1 = vec.getVector(pos);
+      assert(vec1.getData() == data);
+    }
+  }
+  static void benchmark_hash(unsigned int n = 1000000, unsigned int rounds = 10) {
+    std::cout << "--- Benchmark Hash ---" << std::endl;
+    std::vector<std::string> keys;
+    for (unsigned int i = 0; i < n; ++i) {
+      keys.push_back("ISBN" + std::to_string(i * 2654435761u)); // ISBN-like keys
+      if (i % 4 == 0) keys.back() += " a title of sixty characters at most, like the book names";
+    }
+    auto run = [&](const std::string &name, auto &&hash) {
+      external_memory::Hash_t sum = 0;
+      auto start = std::chrono::steady_clock::now();
+      for (unsigned int r = 0; r < rounds; ++r) {
+        for (auto &key : keys) sum += hash(key);
+      }
+      std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+      std::cout << name << ": " << elapsed.count() / n / rounds << " ns per key (" << sum << ")" << std::endl;
+    };
+    run("std::hash", std::hash<std::string>());
+    run("Hash", external_memory::Hash());
+    run("Hash::fingerprint", [](const std::string &key) {
+      auto fingerprint = external_memory::Hash().fingerprint(key);
+      return fingerprint.hash ^ fingerprint.check;
+    });
+  }
 };
 #endif //BOOKSTORE_SRC_MAIN_CPP_TEST_H_
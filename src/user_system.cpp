@@ -36,9 +36,10 @@ bool UserSystem::isLoggedIn(const std::string &user_id) const {
 bool UserSystem::isLoggedIn() const {
   return login_stack_.size() > 1;
 }
-void UserSystem::initialize(bool reset) {
+void UserSystem::initialize(bool reset, bool reset_index) {
   user_list_.initialize(reset);
-  user_id_to_id_.initialize(reset);
+  wal_.protect(user_list_);
+  user_id_to_id_.initialize(reset || reset_index);
   login_stack_.clear();
   login_stack_.emplace_back();
   login_count_.clear();
@@ -71,15 +72,19 @@ kExceptionType UserSystem::useradd(const std::string &user_id,
                                    unsigned int privilege) {
   auto &id = user_id_to_id_[user_id];
   if (id) return kExceptionType::K_USER_ALREADY_EXIST;
-  id = user_list_.insert(User(user_id, password, name, privilege));
+  User user(user_id, password, name, privilege);
+  id = user_list_.insert(user);
+  wal_.log(kRecordType::kUser, id, user);
   return kExceptionType::K_SUCCESS;
 }
 kExceptionType UserSystem::deluser(const std::string &user_id) {
   if (isLoggedIn(user_id)) return kExceptionType::K_USER_IS_LOGGED_IN;
   auto id = find(user_id);
   if (!id) return kExceptionType::K_USER_NOT_FOUND;
+  user_list_.set(id, User()); // privilege 0 marks the element as unused, see `rebuildIndex`
   user_list_.erase(id);
   user_id_to_id_.erase(user_id);
+  wal_.log(kRecordType::kUserErase, id, nullptr, 0);
   return kExceptionType::K_SUCCESS;
 }
 kExceptionType UserSystem::passwd(const std::string &user_id,
@@ -91,8 +96,34 @@ kExceptionType UserSystem::passwd(const std::string &user_id,
   if (!old_password.empty() && user.password != old_password) return kExceptionType::K_WRONG_PASSWORD;
   user.password = new_password;
   user_list_.set(id, user);
+  wal_.log(kRecordType::kUser, id, user);
   return kExceptionType::K_SUCCESS;
 }
+void UserSystem::restore(unsigned int id, const User &user) {
+  user_list_.extend(id);
+  user_list_.set(id, user);
+}
+void UserSystem::rebuildIndex() {
+  user_list_.resetFreeList();
+  std::vector<std::pair<std::string, unsigned int>> user_ids;
+  for (unsigned int id = user_list_.size(); id >= 1; --id) { // erase backwards so that the lowest free element is reused first
+    User user = get(id);
+    if (user.privilege) {
+      user_ids.emplace_back(user.user_id, id);
+    } else {
+      user_list_.erase(id);
+    }
+  }
+  user_id_to_id_.bulkLoad(user_ids);
+}
+void UserSystem::checkpoint() {
+  user_list_.flush();
+  user_id_to_id_.checkpoint();
+}
+void UserSystem::sync() {
+  user_list_.sync();
+  user_id_to_id_.sync();
+}
 unsigned int UserSystem::getPrivilege() const {
   return current_user().privilege;
 }
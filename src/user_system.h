@@ -68,9 +68,10 @@ class UserSystem {
  private:
   const std::string file_prefix_; // the prefix (including path) of the files used to store the information of users
   external_memory::List<User, true> user_list_; // the list of users
-  external_memory::Map<std::string> user_id_to_id_; // the map from user ID to user ID
+  external_memory::Map<std::string> user_id_to_id_; // the map from user ID to user ID, with a filter for unknown user IDs
   std::vector<User> login_stack_; // A default user is always at the bottom of the stack
   std::unordered_map<std::string, size_t> login_count_; // the number of times each user has logged in
+  WriteAheadLog &wal_; // the write-ahead log, shared with other systems
 
   unsigned int find(const std::string &user_id); // return 0 if not found
   User get(unsigned int id); // no bound check
@@ -81,17 +82,30 @@ class UserSystem {
 
  public:
   /// \brief Construct a new UserSystem object
-  explicit UserSystem(std::string file_prefix = "users")
+  UserSystem(std::string file_prefix, WriteAheadLog &wal)
       : file_prefix_(std::move(file_prefix)), user_list_(file_prefix_ + "_list"),
-        user_id_to_id_(file_prefix_ + "_map") {}
+        user_id_to_id_(file_prefix_ + "_map", external_memory::Map<std::string>::kDefaultBucketCount, true), wal_(wal) {}
   /// \brief Destroy the UserSystem object
   ~UserSystem() = default;
   /// \brief Initialize the UserSystem object
   /// \param reset Whether to reset the UserSystem object
+  /// \param reset_index Whether to reset the map from user ID only, which should be rebuilt with `rebuildIndex` afterwards
   /// \attention This function should be called before using any other functions.
   /// \attention This function must not be called twice.
   /// \attention If reset is true, all the information of users will be lost.
-  void initialize(bool reset = false);
+  void initialize(bool reset = false, bool reset_index = false);
+  /// \brief Restore a user from the write-ahead log
+  /// \param id The position of the user in the user list
+  /// \param user The user. A user with privilege 0 is an erased user.
+  /// \details Only the list of users is modified. The index should be rebuilt with `rebuildIndex` afterwards.
+  void restore(unsigned int id, const User &user);
+  /// \brief Rebuild the map from user ID and the free list of the user list
+  /// \attention The map must be empty.
+  void rebuildIndex();
+  /// \brief Write all cached data of users back to the files
+  void checkpoint();
+  /// \brief Write the files of users to the disk, after `checkpoint`
+  void sync();
   /**
    * @brief Login with user ID and password
    * @param user_id The user ID